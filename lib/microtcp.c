@@ -1,6 +1,8 @@
+#define _GNU_SOURCE /* sendmmsg() and recvmmsg() */
 #include "microtcp.h"
 #include <arpa/inet.h>
 #include <errno.h>
+#include <stddef.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <stdio.h>
@@ -10,71 +12,130 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <netinet/udp.h>
+#include <time.h>
 #include <math.h>
 #include "../utils/crc32.h"
 
-microtcp_header_t header;
-void *temp_buffer_recv;
-uint32_t *temp_size;
-struct sockaddr_in *client_address, *server_address;
-int client_sd, server_sd,flow_ctrl_win;
-socklen_t server_address_len, client_address_len;
-int r = 0;
-int add_checksum(uint8_t *packet, int size)
-{
-  microtcp_header_t p;
-  memcpy(&p, packet, 32);
-  p.checksum = 0;
-  memcpy(packet, &p, 32);
-  uint32_t checksum = crc32(packet, size);
-  memcpy(packet + 28, &checksum, 4);
-  return 0;
-}
-int correct_checksum_packet(uint8_t *packet, int size)
+#define SLOT_SIZE (sizeof(microtcp_header_t) + MICROTCP_MSS)
+#define RX_BUF_SIZE 65536       /* Room for a batch of slots or a GRO coalesced datagram */
+#define RX_MAX_DATAGRAMS 64     /* Most datagrams GRO coalesces into one */
+#define RQ_INIT_SIZE 16         /* Initial capacity of the retransmission queue */
+#define WAIT_FOREVER UINT64_MAX /* Timeout of wait_readable() for no timeout */
+/* Bytes in the receive buffers of all the connections, and the cap of autotuning on them */
+static size_t recvbuf_mem;
+static size_t recvbuf_mem_limit = MICROTCP_RECVBUF_MEM_LIMIT;
+
+/* The socket a timer of it is embedded in */
+#define TIMER_SOCKET(timer, field) ((microtcp_sock_t *)((char *)(timer) - offsetof(microtcp_sock_t, field)))
+
+static void init_timers(microtcp_sock_t *socket);
+static void start_close_timer(microtcp_sock_t *socket, uint32_t retries);
+static void send_drain(microtcp_sock_t *socket);
+
+/*
+ * A datagram of the send batch. Its payload is left where it already is,
+ * in the buffer of the application, and sent from there.
+ */
+struct microtcp_tx_datagram
 {
-  microtcp_header_t received_header;
-  memcpy(&received_header, packet, sizeof(microtcp_header_t));
+  microtcp_header_t header;
+  const uint8_t *data;
+};
 
-  uint32_t checksum = received_header.checksum;
-  received_header.checksum = 0;
-  memcpy(packet, &received_header, sizeof(microtcp_header_t));
+/*
+ * A connection accepted by a listener. The listener keeps it in a hash
+ * table by the address of the peer and queues the datagrams of the peer
+ * in it, for the connection to receive.
+ */
+struct microtcp_conn
+{
+  struct microtcp_conn *next;   /* Next in the same hash bucket */
+  struct microtcp_listener *listener;
+  struct sockaddr_storage peer_address;
+  socklen_t peer_address_len;
+  uint32_t head;                /* Slot of the oldest queued datagram */
+  uint32_t len;                 /* Number of queued datagrams */
+  uint32_t sizes[MICROTCP_CONN_QUEUE];
+  uint8_t slots[MICROTCP_CONN_QUEUE][SLOT_SIZE];
+};
 
-  uint32_t calculated_checksum = crc32(packet, size);
+/* A SYN waiting for microtcp_listener_accept() */
+struct microtcp_pending_syn
+{
+  struct sockaddr_storage address;
+  socklen_t address_len;
+  microtcp_header_t header;
+};
 
-  if (checksum != calculated_checksum)
-  {
-    return 0;
-  }
-  return 1;
-}
+struct microtcp_listener
+{
+  int sd;
+  struct microtcp_conn *buckets[MICROTCP_LISTEN_BUCKETS];
+  uint32_t conns;               /* Connections in buckets */
+  struct microtcp_pending_syn *backlog; /* Ring of the SYNs not accepted yet */
+  uint32_t backlog_head;
+  uint32_t backlog_len;
+  uint32_t backlog_size;
+  uint8_t *rx_buf;              /* Datagrams of the last receive, before they are demultiplexed */
+};
 
+/*
+ * CRC-32 of a segment, given as the bytes of its header and its payload,
+ * which need not be contiguous. The checksum field of the header counts
+ * as zero, whatever it holds, so the header is neither copied nor changed.
+ */
+static uint32_t segment_checksum(const uint8_t *hdr, const uint8_t *payload, size_t payload_len)
+{
+  static const uint8_t zero[sizeof(uint32_t)];
+  const size_t at = offsetof(microtcp_header_t, checksum);
+  const size_t after = at + sizeof(zero);
+  uint32_t crc = update_crc32(0xffffffff, hdr, at);
+  crc = update_crc32(crc, zero, sizeof(zero));
+  crc = update_crc32(crc, hdr + after, sizeof(microtcp_header_t) - after);
+  return update_crc32(crc, payload, payload_len) ^ 0xffffffff;
+}
+/* Checks a received segment of size bytes where it lies */
+static int correct_checksum_packet(const uint8_t *packet, size_t size)
+{
+  uint32_t checksum;
+  memcpy(&checksum, packet + offsetof(microtcp_header_t, checksum), sizeof(checksum));
+  size_t payload_len = size - sizeof(microtcp_header_t);
+  return checksum == segment_checksum(packet, packet + sizeof(microtcp_header_t), payload_len);
+}
+/*
+ * Fills in the outgoing header, leaving the checksum to whoever sends it, as
+ * more fields may be set before that.
+ */
+static void fill_header(microtcp_sock_t *socket, uint16_t control_bits)
+{
+  socket->header.seq_number = socket->seq_number;
+  socket->header.ack_number = socket->ack_number;
+  socket->header.control = control_bits;
+  socket->header.data_len = 0;
+  socket->header.future_use0 = 0;
+  socket->header.future_use1 = 0;
+  socket->header.future_use2 = 0;
+  socket->header.checksum = 0;
+}
 void create_header(microtcp_sock_t *socket, uint16_t control_bits)
 {
-  uint8_t *buffer;
-  buffer = malloc(sizeof(microtcp_header_t));
-  header.seq_number = socket->seq_number;
-  header.ack_number = socket->ack_number;
-  header.control = control_bits;
-  header.data_len = 0;
-  header.checksum = 0;
-  memcpy(buffer, &header, 32);
-  header.checksum = crc32(buffer, sizeof(microtcp_header_t));
-  free(buffer);
+  fill_header(socket, control_bits);
+  socket->header.checksum = segment_checksum((const uint8_t *)&socket->header, NULL, 0);
+}
+/*
+ * Recomputes the checksum of the outgoing header, for when fields that
+ * create_header() does not fill in are set afterwards.
+ */
+static void refresh_header_checksum(microtcp_sock_t *socket)
+{
+  socket->header.checksum = segment_checksum((const uint8_t *)&socket->header, NULL, 0);
 }
 int correct_checksum(microtcp_header_t received_header)
 {
-  uint8_t *buffer;
-  buffer = malloc(32);
-  uint32_t checksum = received_header.checksum;
-  received_header.checksum = 0;
-  memcpy(buffer, &received_header, sizeof(microtcp_header_t));
-  if (checksum != crc32(buffer, 32))
-  {
-    free(buffer);
-    return 0;
-  }
-  free(buffer);
-  return 1;
+  return correct_checksum_packet((const uint8_t *)&received_header, sizeof(microtcp_header_t));
 }
 void print_header(microtcp_header_t *packet)
 {
@@ -92,15 +153,25 @@ microtcp_sock_t microtcp_socket(int domain, int type, int protocol)
     perror("Opening UDP listening socket");
     exit(EXIT_FAILURE);
   }
-  microtcp_sock_t *socket = malloc(sizeof(microtcp_sock_t));
-  socket = memset(socket, 0, sizeof(microtcp_sock_t));
+  microtcp_sock_t new_socket;
+  microtcp_sock_t *socket = memset(&new_socket, 0, sizeof(microtcp_sock_t));
   socket->sd = sock;
+  socket->owns_sd = 1;
   socket->state = INVALID;
+  socket->nonblock = (type & MICROTCP_NONBLOCK) != 0;
   socket->init_win_size = MICROTCP_WIN_SIZE;
   socket->curr_win_size = MICROTCP_WIN_SIZE;
-  socket->cwnd = MICROTCP_INIT_CWND;
-  socket->ssthresh = MICROTCP_INIT_SSTHRESH;
-  return *socket;
+  socket->recvbuf_len = MICROTCP_RECVBUF_LEN;
+  socket->rcv_autotune = 1;
+  socket->cc = &microtcp_cc_newreno;
+  socket->cc->init(socket);
+  socket->options = MICROTCP_OPT_SACK | MICROTCP_OPT_TIMESTAMPS | MICROTCP_OPT_WSCALE;
+  socket->ack_ratio = MICROTCP_ACK_RATIO;
+  socket->rto_us = MICROTCP_ACK_TIMEOUT_US;
+  socket->rto_min_us = MICROTCP_MIN_RTO_US;
+  socket->rto_max_us = MICROTCP_MAX_RTO_US;
+  init_timers(socket);
+  return new_socket;
 }
 
 int microtcp_bind(microtcp_sock_t *socket, const struct sockaddr *address,
@@ -116,12 +187,287 @@ int microtcp_bind(microtcp_sock_t *socket, const struct sockaddr *address,
   return 0;
 }
 
+static uint8_t *alloc_buffer(size_t size)
+{
+  uint8_t *buffer = malloc(size);
+  if (buffer == NULL)
+  {
+    perror("Memory allocation failed");
+    exit(EXIT_FAILURE);
+  }
+  return buffer;
+}
+/*
+ * Everything the data path needs is allocated once the connection is
+ * established, so that sending and receiving never touch the heap.
+ */
+static void alloc_connection_buffers(microtcp_sock_t *socket)
+{
+  socket->recvbuf = alloc_buffer(socket->recvbuf_len);
+  __atomic_add_fetch(&recvbuf_mem, socket->recvbuf_len, __ATOMIC_RELAXED);
+  socket->rcv_space_start_us = 0;
+  socket->rcv_space_bytes = 0;
+  socket->buf_fill_level = 0;
+  socket->rcv_head = 0;
+  socket->rcv_fin = 0;
+  socket->tx_batch = (struct microtcp_tx_datagram *)alloc_buffer(MICROTCP_BATCH_SIZE * sizeof(struct microtcp_tx_datagram));
+  socket->tx_len = 0;
+  socket->rx_buf = alloc_buffer(RX_BUF_SIZE);
+  socket->retrans_queue = (microtcp_segment_t *)alloc_buffer(RQ_INIT_SIZE * sizeof(microtcp_segment_t));
+  socket->rq_size = RQ_INIT_SIZE;
+  socket->rq_head = 0;
+  socket->rq_len = 0;
+}
+/*
+ * The local end is the same for all the connections of a listener, so the
+ * address and port of the peer are what tell their 4-tuples apart.
+ */
+static const uint8_t *address_key(const struct sockaddr *address, size_t *len, uint16_t *port)
+{
+  if (address->sa_family == AF_INET6)
+  {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)address;
+    *len = sizeof(in6->sin6_addr);
+    *port = in6->sin6_port;
+    return (const uint8_t *)&in6->sin6_addr;
+  }
+  const struct sockaddr_in *in = (const struct sockaddr_in *)address;
+  *len = sizeof(in->sin_addr);
+  *port = in->sin_port;
+  return (const uint8_t *)&in->sin_addr;
+}
+/* FNV-1a of the address and port of the peer */
+static uint32_t address_hash(const struct sockaddr *address)
+{
+  size_t len;
+  uint16_t port;
+  const uint8_t *key = address_key(address, &len, &port);
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+  {
+    hash = (hash ^ key[i]) * 16777619u;
+  }
+  hash = (hash ^ (port & 0xff)) * 16777619u;
+  hash = (hash ^ (port >> 8)) * 16777619u;
+  return hash & (MICROTCP_LISTEN_BUCKETS - 1);
+}
+static int same_address(const struct sockaddr *a, const struct sockaddr *b)
+{
+  size_t a_len, b_len;
+  uint16_t a_port, b_port;
+  const uint8_t *a_key = address_key(a, &a_len, &a_port);
+  const uint8_t *b_key = address_key(b, &b_len, &b_port);
+  return a->sa_family == b->sa_family && a_port == b_port && memcmp(a_key, b_key, a_len) == 0;
+}
+static struct microtcp_conn *conn_lookup(struct microtcp_listener *listener, const struct sockaddr *address)
+{
+  struct microtcp_conn *conn = listener->buckets[address_hash(address)];
+  while (conn != NULL && !same_address((struct sockaddr *)&conn->peer_address, address))
+  {
+    conn = conn->next;
+  }
+  return conn;
+}
+static struct microtcp_conn *conn_create(struct microtcp_listener *listener,
+                                         const struct sockaddr *address, socklen_t address_len)
+{
+  struct microtcp_conn *conn = (struct microtcp_conn *)alloc_buffer(sizeof(struct microtcp_conn));
+  memset(conn, 0, offsetof(struct microtcp_conn, sizes));
+  conn->listener = listener;
+  memcpy(&conn->peer_address, address, address_len);
+  conn->peer_address_len = address_len;
+  uint32_t bucket = address_hash(address);
+  conn->next = listener->buckets[bucket];
+  listener->buckets[bucket] = conn;
+  listener->conns++;
+  return conn;
+}
+static void conn_destroy(struct microtcp_conn *conn)
+{
+  struct microtcp_listener *listener = conn->listener;
+  struct microtcp_conn **link = &listener->buckets[address_hash((struct sockaddr *)&conn->peer_address)];
+  while (*link != conn)
+  {
+    link = &(*link)->next;
+  }
+  *link = conn->next;
+  listener->conns--;
+  free(conn);
+}
+/*
+ * Puts a SYN of a peer without a connection in the backlog, unless it is
+ * full or the peer is already there.
+ */
+static void backlog_push(struct microtcp_listener *listener, const struct sockaddr *address,
+                         socklen_t address_len, const uint8_t *datagram, size_t size)
+{
+  microtcp_header_t syn;
+  if (size != sizeof(syn) || !correct_checksum_packet(datagram, size) ||
+      listener->backlog_len == listener->backlog_size)
+  {
+    return;
+  }
+  memcpy(&syn, datagram, sizeof(syn));
+  if (!(syn.control & (1 << 13)) || (syn.control & (1 << 11)))
+  {
+    return;
+  }
+  for (uint32_t i = 0; i < listener->backlog_len; i++)
+  {
+    struct microtcp_pending_syn *pending = &listener->backlog[(listener->backlog_head + i) % listener->backlog_size];
+    if (same_address((struct sockaddr *)&pending->address, address))
+    {
+      return;
+    }
+  }
+  struct microtcp_pending_syn *pending =
+      &listener->backlog[(listener->backlog_head + listener->backlog_len++) % listener->backlog_size];
+  memcpy(&pending->address, address, address_len);
+  pending->address_len = address_len;
+  pending->header = syn;
+}
+/*
+ * Receives a batch of datagrams on the socket of the listener, blocking
+ * for the first one unless flags has MSG_DONTWAIT, and hands each to the
+ * connection of its sender. What does not fit in the queue of the
+ * connection is dropped, like any datagram of an unknown peer that is not
+ * a SYN. Returns how many datagrams arrived, or -1 on error.
+ */
+static int listener_receive(struct microtcp_listener *listener, int flags)
+{
+  struct mmsghdr msgs[MICROTCP_BATCH_SIZE];
+  struct iovec iov[MICROTCP_BATCH_SIZE];
+  struct sockaddr_storage addresses[MICROTCP_BATCH_SIZE];
+  memset(msgs, 0, sizeof(msgs));
+  for (int i = 0; i < MICROTCP_BATCH_SIZE; i++)
+  {
+    iov[i].iov_base = listener->rx_buf + i * SLOT_SIZE;
+    iov[i].iov_len = SLOT_SIZE;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &addresses[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+  }
+  int n = recvmmsg(listener->sd, msgs, MICROTCP_BATCH_SIZE,
+                   flags & MSG_DONTWAIT ? flags : flags | MSG_WAITFORONE, NULL);
+  for (int i = 0; i < n; i++)
+  {
+    const struct sockaddr *from = (struct sockaddr *)&addresses[i];
+    struct microtcp_conn *conn = conn_lookup(listener, from);
+    if (conn == NULL)
+    {
+      backlog_push(listener, from, msgs[i].msg_hdr.msg_namelen, iov[i].iov_base, msgs[i].msg_len);
+    }
+    else if (conn->len < MICROTCP_CONN_QUEUE)
+    {
+      uint32_t slot = (conn->head + conn->len++) % MICROTCP_CONN_QUEUE;
+      memcpy(conn->slots[slot], iov[i].iov_base, msgs[i].msg_len);
+      conn->sizes[slot] = msgs[i].msg_len;
+    }
+  }
+  return n;
+}
+/*
+ * Receives on the socket of the listener until a datagram is queued for
+ * conn, or just once if flags has MSG_DONTWAIT. Returns 0 once there is
+ * one, or -1 with errno set.
+ */
+static int conn_wait(struct microtcp_conn *conn, int flags)
+{
+  while (conn->len == 0)
+  {
+    if (listener_receive(conn->listener, flags) == -1)
+    {
+      return -1;
+    }
+    if ((flags & MSG_DONTWAIT) && conn->len == 0)
+    {
+      errno = EAGAIN;
+      return -1;
+    }
+  }
+  return 0;
+}
+/*
+ * recvfrom() for the connection, through the listener if it has one.
+ */
+static ssize_t recv_datagram(microtcp_sock_t *socket, void *buffer, size_t length, int flags,
+                             struct sockaddr *address, socklen_t *address_len)
+{
+  struct microtcp_conn *conn = socket->conn;
+  if (conn == NULL)
+  {
+    return recvfrom(socket->sd, buffer, length, flags, address, address_len);
+  }
+  if (conn_wait(conn, flags) == -1)
+  {
+    return -1;
+  }
+  size_t size = conn->sizes[conn->head] < length ? conn->sizes[conn->head] : length;
+  memcpy(buffer, conn->slots[conn->head], size);
+  conn->head = (conn->head + 1) % MICROTCP_CONN_QUEUE;
+  conn->len--;
+  if (address != NULL)
+  {
+    *address_len = *address_len < conn->peer_address_len ? *address_len : conn->peer_address_len;
+    memcpy(address, &conn->peer_address, *address_len);
+  }
+  return size;
+}
+/*
+ * Takes the timers of the sender off the wheel, which would otherwise
+ * fire on the socket from whatever call advances it next.
+ */
+static void disarm_sender_timers(microtcp_sock_t *socket)
+{
+  microtcp_timer_cancel(&socket->rto_timer);
+  microtcp_timer_cancel(&socket->pace_timer);
+  microtcp_timer_cancel(&socket->persist_timer);
+}
+static void free_connection_buffers(microtcp_sock_t *socket)
+{
+  disarm_sender_timers(socket);
+  microtcp_timer_cancel(&socket->ack_timer);
+  microtcp_timer_cancel(&socket->delack_timer);
+  microtcp_timer_cancel(&socket->close_timer);
+  if (socket->conn != NULL)
+  {
+    conn_destroy(socket->conn);
+    socket->conn = NULL;
+  }
+  if (socket->recvbuf != NULL)
+  {
+    __atomic_sub_fetch(&recvbuf_mem, socket->recvbuf_len, __ATOMIC_RELAXED);
+  }
+  free(socket->recvbuf);
+  free(socket->retrans_queue);
+  free(socket->tx_batch);
+  free(socket->rx_buf);
+  free(socket->snd_copy);
+  socket->recvbuf = NULL;
+  socket->snd_copy = NULL;
+  socket->snd_copy_size = 0;
+  socket->retrans_queue = NULL;
+  socket->tx_batch = NULL;
+  socket->rx_buf = NULL;
+  socket->rq_size = 0;
+}
+/* Remembers where the segments of the connection go */
+static void set_peer_address(microtcp_sock_t *socket, const struct sockaddr *address,
+                             socklen_t address_len)
+{
+  if (address_len > sizeof(socket->peer_address))
+  {
+    address_len = sizeof(socket->peer_address);
+  }
+  memcpy(&socket->peer_address, address, address_len);
+  socket->peer_address_len = address_len;
+}
 int microtcp_connect(microtcp_sock_t *socket, const struct sockaddr *address,
                      socklen_t address_len)
 {
-  server_address = (struct sockaddr_in *)address;
-  server_address_len = address_len;
-  client_sd = socket->sd;
+  socket->is_client = 1;
+  set_peer_address(socket, address, address_len);
   socket->state = INVALID;
 //  printf("Try connection to the server.....\n");
  // printf("\n3-Way handshake\n\n");
@@ -129,10 +475,20 @@ int microtcp_connect(microtcp_sock_t *socket, const struct sockaddr *address,
   receive_syn_ack_send_ack(socket, (struct sockaddr *)address, address_len);
  // printf("Connected!\n");
   socket->state = ESTABLISHED;
-  socket->recvbuf = malloc(MICROTCP_RECVBUF_LEN);
+  alloc_connection_buffers(socket);
   return 0;
 }
 
+/* Completes the passive open of a connection once the handshake is over */
+static void establish_accepted(microtcp_sock_t *socket, const struct sockaddr *address,
+                               socklen_t address_len)
+{
+  socket->is_client = 0;
+  set_peer_address(socket, address, address_len);
+  socket->ack_number++;
+  socket->state = ESTABLISHED;
+  alloc_connection_buffers(socket);
+}
 int microtcp_accept(microtcp_sock_t *socket, struct sockaddr *address,
                     socklen_t address_len)
 {
@@ -141,299 +497,1798 @@ int microtcp_accept(microtcp_sock_t *socket, struct sockaddr *address,
   receive_syn_send_SynAck(socket, address, address_len);
   receive_ack(socket, address, address_len);
   //printf("Accepted\n");
-  server_sd = socket->sd;
-  client_address = (struct sockaddr_in *)address;
-  client_address_len = address_len;
-  socket->ack_number++;
-  socket->state = ESTABLISHED;
-  socket->recvbuf = malloc(MICROTCP_RECVBUF_LEN);
+  establish_accepted(socket, address, address_len);
+  return 0;
+}
+int microtcp_set_rto_bounds(microtcp_sock_t *socket, uint64_t min_us, uint64_t max_us)
+{
+  if (min_us == 0 || min_us > max_us)
+  {
+    return -1;
+  }
+  socket->rto_min_us = min_us;
+  socket->rto_max_us = max_us;
+  socket->rto_us = socket->rto_us < min_us ? min_us : socket->rto_us;
+  socket->rto_us = socket->rto_us > max_us ? max_us : socket->rto_us;
+  return 0;
+}
+int microtcp_set_pacing(microtcp_sock_t *socket, int enable, uint64_t max_rate)
+{
+  if (enable != 0 && enable != 1)
+  {
+    return -1;
+  }
+  socket->pacing = enable;
+  socket->max_pacing_rate = max_rate;
+  socket->next_send_us = 0;
+  return 0;
+}
+int microtcp_set_ack_ratio(microtcp_sock_t *socket, uint32_t ratio)
+{
+  if (ratio == 0 || ratio > MICROTCP_MAX_ACK_RATIO)
+  {
+    return -1;
+  }
+  socket->ack_ratio = ratio;
+  return 0;
+}
+int microtcp_set_rcvbuf(microtcp_sock_t *socket, size_t size)
+{
+  if (size < MICROTCP_MSS || size > MICROTCP_MAX_RECVBUF_LEN || socket->recvbuf != NULL)
+  {
+    return -1;
+  }
+  socket->recvbuf_len = size;
+  socket->init_win_size = size;
+  socket->curr_win_size = size;
+  socket->rcv_autotune = 0;
+  return 0;
+}
+void microtcp_set_rcvbuf_limit(size_t limit)
+{
+  __atomic_store_n(&recvbuf_mem_limit, limit, __ATOMIC_RELAXED);
+}
+int microtcp_set_reuseport(microtcp_sock_t *socket, int enable)
+{
+  if (enable != 0 && enable != 1)
+  {
+    return -1;
+  }
+  if (setsockopt(socket->sd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1)
+  {
+    perror("SO_REUSEPORT");
+    return -1;
+  }
+  return 0;
+}
+int microtcp_set_offload(microtcp_sock_t *socket, uint32_t offload)
+{
+  int value;
+  socklen_t value_len = sizeof(value);
+  if ((offload & MICROTCP_OFFLOAD_GSO) &&
+      getsockopt(socket->sd, SOL_UDP, UDP_SEGMENT, &value, &value_len) == -1)
+  {
+    perror("UDP segmentation offload");
+    return -1;
+  }
+  if ((offload & MICROTCP_OFFLOAD_GRO) && (socket->listener != NULL || socket->conn != NULL))
+  {
+    /* The listener takes the datagrams of every peer one by one */
+    return -1;
+  }
+  value = (offload & MICROTCP_OFFLOAD_GRO) != 0;
+  if (setsockopt(socket->sd, SOL_UDP, UDP_GRO, &value, sizeof(value)) == -1 && value)
+  {
+    perror("UDP receive offload");
+    return -1;
+  }
+  socket->offload = offload & (MICROTCP_OFFLOAD_GSO | MICROTCP_OFFLOAD_GRO);
+  return 0;
+}
+static int listener_shutdown(microtcp_sock_t *socket)
+{
+  struct microtcp_listener *listener = socket->listener;
+  if (listener->conns > 0)
+  {
+    return -1;
+  }
+  free(listener->backlog);
+  free(listener->rx_buf);
+  free(listener);
+  socket->listener = NULL;
+  socket->state = CLOSED;
   return 0;
 }
 int microtcp_shutdown(microtcp_sock_t *socket, int how)
 {
-  uint8_t *buffer = malloc(32);
-  socket->state = CLOSING_BY_PEER;
-  if (buffer == NULL)
+  if (socket->listener != NULL)
   {
-    // Handle memory allocation failure
-    exit(EXIT_FAILURE);
+    return listener_shutdown(socket);
   }
-
-  // Optionally initialize the buffer
-  memset(buffer, 0, 32);
+  /* The teardown blocks, whatever the socket, and sees the data a
+     non-blocking send left in the buffer through first */
+  socket->nonblock = 0;
+  send_drain(socket);
+  uint8_t buffer[32];
+  socket->state = CLOSING_BY_PEER;
   int length = 32;
   uint16_t control = 0;
   control |= (1 << 11);
   control |= (1 << 14);
   create_header(socket, control);
  // printf("FIN,ACK,seq=X:\n");
- // print_header(&header);
+ // print_header(&socket->header);
   ssize_t bytes_sent =
-      sendto(socket->sd, &header, sizeof(microtcp_header_t), 0,
-             (struct sockaddr *)server_address, server_address_len);
+      sendto(socket->sd, &socket->header, sizeof(microtcp_header_t), 0,
+             (struct sockaddr *)&socket->peer_address, socket->peer_address_len);
   socket->seq_number++;
+  /* The FIN goes again while the peer does not answer it */
+  start_close_timer(socket, 0);
   ssize_t bytes_received_ack = microtcp_recv(socket, buffer, length, 0);
+  if (bytes_received_ack != -1)
+  {
+    /* Then the FIN of the peer gets one more timeout to arrive */
+    start_close_timer(socket, MICROTCP_FIN_RETRIES);
+  }
   ssize_t bytes_received_fin_ack = microtcp_recv(socket, buffer, length, 0);
+  microtcp_timer_cancel(&socket->close_timer);
   socket->state = CLOSING_BY_HOST;
   //printf("ACK,seq=X+1,ack=Y+1:\n");
-  send_ack(socket, (struct sockaddr *)server_address, server_address_len);
+  send_ack(socket, (struct sockaddr *)&socket->peer_address, socket->peer_address_len);
   socket->state = CLOSED;
-  free(buffer);
-  free(socket->recvbuf);
+  free_connection_buffers(socket);
   return 0;
 }
+int microtcp_close(microtcp_sock_t *socket)
+{
+  if (socket->listener != NULL)
+  {
+    errno = EBUSY;
+    return -1;
+  }
+  if (!socket->owns_sd)
+  {
+    return 0;
+  }
+  socket->owns_sd = 0;
+  return close(socket->sd);
+}
 void send_ack(microtcp_sock_t *socket, struct sockaddr *address,
               socklen_t address_len)
 {
   uint16_t control = 0;
   control |= (1 << 11);
   create_header(socket, control);
-  //print_header(&header);
-  ssize_t bytes_sent = sendto(socket->sd, &header, sizeof(microtcp_header_t), 0,
+  //print_header(&socket->header);
+  ssize_t bytes_sent = sendto(socket->sd, &socket->header, sizeof(microtcp_header_t), 0,
                               address, address_len);
 }
 int server_shutdown(microtcp_sock_t *socket)
 {
-  uint8_t *buffer = malloc(32);
+  uint8_t buffer[32];
   socket->state = CLOSING_BY_HOST;
-  if (buffer == NULL)
-  {
-    // Handle memory allocation failure
-    exit(EXIT_FAILURE);
-  }
-
-  // Optionally initialize the buffersend_CPack
-  memset(buffer, 0, 32);
   int length = 32;
   uint16_t control = 0;
   control |= (1 << 11);
   create_header(socket, control);
  // printf("ACK,ack=X+1:\n");
- // print_header(&header);
+ // print_header(&socket->header);
   ssize_t bytes_sent_ack =
-      sendto(socket->sd, &header, sizeof(microtcp_header_t), 0,
-             (struct sockaddr *)client_address, client_address_len);
+      sendto(socket->sd, &socket->header, sizeof(microtcp_header_t), 0,
+             (struct sockaddr *)&socket->peer_address, socket->peer_address_len);
   socket->seq_number++; // NEW SEQ NUMBER Y
   control |= (1 << 14);
   create_header(socket, control);
  // printf("FIN,ACK,seq=Y:\n");
- // print_header(&header);
+ // print_header(&socket->header);
   ssize_t bytes_sent_fin_ack =
-      sendto(socket->sd, &header, sizeof(microtcp_header_t), 0,
-             (struct sockaddr *)client_address, client_address_len);
+      sendto(socket->sd, &socket->header, sizeof(microtcp_header_t), 0,
+             (struct sockaddr *)&socket->peer_address, socket->peer_address_len);
   socket->seq_number++;
-  ssize_t bytes_received_ack = microtcp_recv(socket, buffer, length, 0);
+  ssize_t bytes_received_ack = -1;
+  if (!socket->nonblock)
+  {
+    start_close_timer(socket, 0);
+    bytes_received_ack = microtcp_recv(socket, buffer, length, 0);
+    microtcp_timer_cancel(&socket->close_timer);
+  }
   socket->state = CLOSED;
-  free(buffer);
-  free(socket->recvbuf);
+  free_connection_buffers(socket);
   return bytes_received_ack;
 }
-void set_timeout(int receive_socket)
+/*
+ * Monotonic time in microseconds, used for the retransmission timers.
+ */
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+/*
+ * Timers of the sockets that are not in an event loop. The ones of a
+ * blocking socket are all disarmed when its call returns, so the sockets
+ * of a thread do not get in each other's way.
+ */
+static __thread microtcp_timer_wheel_t thread_wheel;
+
+static microtcp_timer_wheel_t *socket_wheel(microtcp_sock_t *socket)
+{
+  return socket->wheel != NULL ? socket->wheel : &thread_wheel;
+}
+/*
+ * Stamps the outgoing header with TSval and TSecr.
+ */
+static void add_timestamps(microtcp_sock_t *socket)
+{
+  if (socket->options & MICROTCP_OPT_TIMESTAMPS)
+  {
+    socket->header.future_use0 = (uint32_t)now_us();
+    socket->header.future_use1 = socket->ts_recent;
+  }
+}
+/*
+ * Returns the address of the remote end of the connection.
+ */
+static struct sockaddr *peer_address(microtcp_sock_t *socket, socklen_t *address_len)
+{
+  *address_len = socket->peer_address_len;
+  return (struct sockaddr *)&socket->peer_address;
+}
+/* The window field of an outgoing header, for a window of that many bytes */
+static uint16_t advertised_window(size_t window, uint32_t shift)
+{
+  window >>= shift;
+  return window > 0xffff ? 0xffff : window;
+}
+/*
+ * Serial number arithmetic, so that the comparisons survive the wrap around
+ * of the 32-bit sequence space.
+ */
+static inline int seq_before(uint32_t a, uint32_t b)
+{
+  return (int32_t)(a - b) < 0;
+}
+static inline int seq_after(uint32_t a, uint32_t b)
+{
+  return (int32_t)(a - b) > 0;
+}
+static microtcp_segment_t *rq_push(microtcp_sock_t *socket)
+{
+  if (socket->rq_len == socket->rq_size)
+  {
+    size_t new_size = socket->rq_size ? 2 * socket->rq_size : RQ_INIT_SIZE;
+    microtcp_segment_t *queue = malloc(new_size * sizeof(microtcp_segment_t));
+    if (queue == NULL)
+    {
+      perror("Memory allocation failed");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < socket->rq_len; i++)
+    {
+      queue[i] = socket->retrans_queue[(socket->rq_head + i) % socket->rq_size];
+    }
+    free(socket->retrans_queue);
+    socket->retrans_queue = queue;
+    socket->rq_head = 0;
+    socket->rq_size = new_size;
+  }
+  socket->rq_len++;
+  return &socket->retrans_queue[(socket->rq_head + socket->rq_len - 1) % socket->rq_size];
+}
+static microtcp_segment_t *rq_front(microtcp_sock_t *socket)
+{
+  return &socket->retrans_queue[socket->rq_head];
+}
+static void rq_pop(microtcp_sock_t *socket)
+{
+  socket->rq_head = (socket->rq_head + 1) % socket->rq_size;
+  socket->rq_len--;
+}
+/*
+ * PAWS: a segment stamped earlier than the latest in order one is an old
+ * duplicate. The check is skipped after a long idle period, when the 32-bit
+ * microsecond clock of the peer may have wrapped.
+ */
+static int paws_reject(microtcp_sock_t *socket, const microtcp_header_t *h)
+{
+  return (socket->options & MICROTCP_OPT_TIMESTAMPS) && socket->ts_recent_us != 0 &&
+         now_us() - socket->ts_recent_us < MICROTCP_PAWS_IDLE_US &&
+         seq_before(h->future_use0, socket->ts_recent);
+}
+/*
+ * Remembers the timestamp of a segment to echo it back, if it is not older
+ * than the one held.
+ */
+static void update_ts_recent(microtcp_sock_t *socket, const microtcp_header_t *h)
+{
+  if (socket->ts_recent_us == 0 || !seq_before(h->future_use0, socket->ts_recent))
+  {
+    socket->ts_recent = h->future_use0;
+    socket->ts_recent_us = now_us();
+  }
+}
+/*
+ * Sends the queued datagrams from first on, with as few system calls as
+ * possible, each as a header and a payload iovec. With GSO each run of
+ * full segments leaves as a single message that the kernel cuts into
+ * datagrams.
+ */
+static void send_slots(microtcp_sock_t *socket, uint32_t first)
+{
+  struct mmsghdr msgs[MICROTCP_BATCH_SIZE];
+  struct iovec iov[2 * MICROTCP_BATCH_SIZE];
+  uint32_t msg_slot[MICROTCP_BATCH_SIZE];
+  union
+  {
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+  } control[MICROTCP_BATCH_SIZE];
+  socklen_t addr_len;
+  struct sockaddr *addr_to_send = peer_address(socket, &addr_len);
+  uint32_t n = 0;
+  uint32_t k = 0;
+  memset(msgs, 0, sizeof(msgs));
+  for (uint32_t i = first; i < socket->tx_len; n++)
+  {
+    msg_slot[n] = i;
+    msgs[n].msg_hdr.msg_name = addr_to_send;
+    msgs[n].msg_hdr.msg_namelen = addr_len;
+    msgs[n].msg_hdr.msg_iov = &iov[k];
+    uint32_t count = 0;
+    do
+    {
+      struct microtcp_tx_datagram *datagram = &socket->tx_batch[i + count];
+      iov[k].iov_base = &datagram->header;
+      iov[k++].iov_len = sizeof(microtcp_header_t);
+      if (datagram->header.data_len > 0)
+      {
+        iov[k].iov_base = (void *)datagram->data;
+        iov[k++].iov_len = datagram->header.data_len;
+      }
+      count++;
+    } while ((socket->offload & MICROTCP_OFFLOAD_GSO) && i + count < socket->tx_len &&
+             socket->tx_batch[i + count - 1].header.data_len == MICROTCP_MSS);
+    msgs[n].msg_hdr.msg_iovlen = &iov[k] - msgs[n].msg_hdr.msg_iov;
+    if (count > 1)
+    {
+      msgs[n].msg_hdr.msg_control = control[n].buf;
+      msgs[n].msg_hdr.msg_controllen = sizeof(control[n].buf);
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[n].msg_hdr);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      uint16_t segment_size = SLOT_SIZE;
+      memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+    }
+    i += count;
+  }
+  uint32_t sent = 0;
+  while (sent < n)
+  {
+    int ret = sendmmsg(socket->sd, msgs + sent, n - sent, 0);
+    if (ret == -1)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      if ((socket->offload & MICROTCP_OFFLOAD_GSO) && (errno == EIO || errno == EINVAL))
+      {
+        /* The device cannot checksum the segments, send them one by one */
+        socket->offload &= ~MICROTCP_OFFLOAD_GSO;
+        send_slots(socket, msg_slot[sent]);
+        return;
+      }
+      perror("sendmmsg"); // the rest is lost, as a failed sendto() would be
+      break;
+    }
+    sent += ret;
+  }
+  socket->tx_len = 0;
+}
+static void flush_tx(microtcp_sock_t *socket)
+{
+  send_slots(socket, 0);
+}
+/*
+ * Receives the datagrams queued on the socket into rx_buf, blocking for
+ * the first one unless flags has MSG_DONTWAIT. A GRO coalesced datagram
+ * is split back into the datagrams of the peer. Returns how many there
+ * are, or -1 on error.
+ */
+static int receive_batch(microtcp_sock_t *socket, int flags, uint8_t **datagrams, size_t *sizes)
+{
+  struct microtcp_conn *conn = socket->conn;
+  if (conn != NULL)
+  {
+    /* Handed out in place, the slots are reused no sooner than the next receive */
+    if (conn_wait(conn, flags) == -1)
+    {
+      return -1;
+    }
+    int n = 0;
+    for (; conn->len > 0 && n < RX_MAX_DATAGRAMS; n++)
+    {
+      datagrams[n] = conn->slots[conn->head];
+      sizes[n] = conn->sizes[conn->head];
+      conn->head = (conn->head + 1) % MICROTCP_CONN_QUEUE;
+      conn->len--;
+    }
+    return n;
+  }
+  if (!(socket->offload & MICROTCP_OFFLOAD_GRO))
+  {
+    struct mmsghdr msgs[MICROTCP_BATCH_SIZE];
+    struct iovec iov[MICROTCP_BATCH_SIZE];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < MICROTCP_BATCH_SIZE; i++)
+    {
+      iov[i].iov_base = socket->rx_buf + i * SLOT_SIZE;
+      iov[i].iov_len = SLOT_SIZE;
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int n = recvmmsg(socket->sd, msgs, MICROTCP_BATCH_SIZE,
+                     flags & MSG_DONTWAIT ? flags : flags | MSG_WAITFORONE, NULL);
+    for (int i = 0; i < n; i++)
+    {
+      datagrams[i] = iov[i].iov_base;
+      sizes[i] = msgs[i].msg_len;
+    }
+    return n;
+  }
+  union
+  {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = {socket->rx_buf, RX_BUF_SIZE};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  ssize_t len = recvmsg(socket->sd, &msg, flags);
+  if (len == -1)
+  {
+    return -1;
+  }
+  size_t segment_size = len > 0 ? len : 1;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+  {
+    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+    {
+      int gso_size;
+      memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+      segment_size = gso_size > 0 ? (size_t)gso_size : segment_size;
+    }
+  }
+  int n = 0;
+  for (size_t offset = 0; offset < (size_t)len && n < RX_MAX_DATAGRAMS; offset += segment_size, n++)
+  {
+    datagrams[n] = socket->rx_buf + offset;
+    sizes[n] = (size_t)len - offset < segment_size ? (size_t)len - offset : segment_size;
+  }
+  return n;
+}
+/*
+ * Queues the outgoing header followed by data for the next flush_tx(). The
+ * data must stay in place until then.
+ */
+static void queue_datagram(microtcp_sock_t *socket, const uint8_t *data, size_t data_len)
+{
+  if (socket->tx_len == MICROTCP_BATCH_SIZE)
+  {
+    flush_tx(socket);
+  }
+  struct microtcp_tx_datagram *datagram = &socket->tx_batch[socket->tx_len++];
+  datagram->header = socket->header;
+  datagram->data = data;
+  /* The checksum runs over the header and then the payload where it lies */
+  datagram->header.checksum = segment_checksum((const uint8_t *)&datagram->header, data, data_len);
+}
+/* Waits up to timeout_us, or WAIT_FOREVER, for data on sd, returns 0 if none arrived */
+static int wait_readable(int sd, uint64_t timeout_us)
+{
+  fd_set fds;
+  FD_ZERO(&fds);
+  FD_SET(sd, &fds);
+  struct timeval tv;
+  tv.tv_sec = timeout_us / 1000000;
+  tv.tv_usec = timeout_us % 1000000;
+  int ret = select(sd + 1, &fds, NULL, NULL, timeout_us == WAIT_FOREVER ? NULL : &tv);
+  return ret == -1 && errno == EINTR ? 0 : ret;
+}
+/* Bytes per second to pace at, 0 if there is no rate to pace at yet */
+static uint64_t pacing_rate(microtcp_sock_t *socket)
+{
+  uint64_t rate = socket->cc->pacing_rate(socket);
+  if (rate == 0 && socket->srtt_us > 0)
+  {
+    /* A window per round trip, with some headroom for the window to grow,
+       a lot of it in slow start */
+    uint64_t window = socket->flow_ctrl_win < socket->cwnd ? socket->flow_ctrl_win : socket->cwnd;
+    uint64_t gain = socket->cwnd < socket->ssthresh ? 200 : 120;
+    rate = window * 1000000 / socket->srtt_us * gain / 100;
+  }
+  if (socket->max_pacing_rate > 0 && (rate == 0 || rate > socket->max_pacing_rate))
+  {
+    rate = socket->max_pacing_rate;
+  }
+  return rate;
+}
+/* Whether pacing holds back the next segment */
+static int paced(microtcp_sock_t *socket)
+{
+  return socket->pacing && socket->next_send_us > now_us();
+}
+/*
+ * Whether nothing follows the segment until it is acknowledged, as it is
+ * a retransmission, ends the message or fills the window, so that the
+ * receiver must not hold its ACK back.
+ */
+static int awaits_ack(microtcp_sock_t *socket, const microtcp_segment_t *segment)
+{
+  size_t window = socket->flow_ctrl_win < socket->cwnd ? socket->flow_ctrl_win : socket->cwnd;
+  return segment->retransmits > 0 ||
+         (uint32_t)(segment->seq_number + segment->data_len - socket->snd_first) >= socket->snd_length ||
+         socket->pipe + segment->data_len + MICROTCP_MSS > window;
+}
+static void transmit_segment(microtcp_sock_t *socket, microtcp_segment_t *segment)
+{
+  size_t final_size = sizeof(microtcp_header_t) + segment->data_len;
+  fill_header(socket, socket->ack_ratio > 1 && awaits_ack(socket, segment) ? MICROTCP_ACK_NOW : 0);
+  socket->header.seq_number = segment->seq_number;
+  socket->header.data_len = segment->data_len;
+  add_timestamps(socket);
+  queue_datagram(socket, segment->data, segment->data_len);
+  segment->sent_us = now_us();
+  segment->flags &= ~MICROTCP_SEG_LOST;
+  socket->pipe += segment->data_len;
+  if (socket->pacing)
+  {
+    uint64_t rate = pacing_rate(socket);
+    /* A late wakeup may be made up for, by at most a short burst */
+    uint64_t start = socket->next_send_us + MICROTCP_PACING_BURST_US > segment->sent_us
+                         ? socket->next_send_us
+                         : segment->sent_us - MICROTCP_PACING_BURST_US;
+    socket->next_send_us = rate > 0 ? start + final_size * 1000000 / rate : 0;
+  }
+  if (!microtcp_timer_armed(&socket->rto_timer))
+  {
+    microtcp_timer_arm(socket_wheel(socket), &socket->rto_timer, segment->sent_us + socket->rto_us);
+  }
+  socket->packets_send++;
+  socket->bytes_send += segment->data_len;
+}
+static void mark_lost(microtcp_sock_t *socket, microtcp_segment_t *segment)
+{
+  if (segment->flags & (MICROTCP_SEG_LOST | MICROTCP_SEG_SACKED))
+  {
+    return;
+  }
+  segment->flags |= MICROTCP_SEG_LOST;
+  socket->pipe -= segment->data_len;
+  socket->packets_lost++;
+  socket->bytes_lost += segment->data_len;
+}
+/*
+ * Retransmits, oldest first, the segments marked as lost, as far as the
+ * congestion window allows. Returns 1 if the window filled up before all
+ * of them went out.
+ */
+static int retransmit_lost(microtcp_sock_t *socket, size_t window)
+{
+  for (size_t i = 0; i < socket->rq_len; i++)
+  {
+    microtcp_segment_t *segment = &socket->retrans_queue[(socket->rq_head + i) % socket->rq_size];
+    if (!(segment->flags & MICROTCP_SEG_LOST))
+    {
+      continue;
+    }
+    if ((socket->pipe > 0 && socket->pipe + segment->data_len > window) || paced(socket))
+    {
+      return 1;
+    }
+    segment->retransmits++;
+    transmit_segment(socket, segment);
+  }
+  return 0;
+}
+/* Resends a lost segment without waiting for room in the window */
+static void retransmit_now(microtcp_sock_t *socket, microtcp_segment_t *segment)
+{
+  if (segment->flags & MICROTCP_SEG_LOST)
+  {
+    segment->retransmits++;
+    transmit_segment(socket, segment);
+  }
+}
+/*
+ * The retransmission timer expired. The oldest segment and every other one
+ * that has been waiting for an ACK for a whole timeout are considered lost,
+ * the rest are still given the benefit of the doubt.
+ */
+static void on_retransmission_timeout(microtcp_sock_t *socket, uint64_t now)
+{
+  socket->cc->on_timeout(socket);
+  socket->dup_acks = 0;
+  microtcp_timer_cancel(&socket->rto_timer);
+  mark_lost(socket, rq_front(socket));
+  for (size_t i = 1; i < socket->rq_len; i++)
+  {
+    microtcp_segment_t *segment = &socket->retrans_queue[(socket->rq_head + i) % socket->rq_size];
+    if (segment->sent_us + socket->rto_us <= now)
+    {
+      mark_lost(socket, segment);
+    }
+  }
+  /* Exponential backoff, until an ACK for new data brings a fresh sample */
+  socket->rto_us = 2 * socket->rto_us < socket->rto_max_us ? 2 * socket->rto_us : socket->rto_max_us;
+  /* Fast recovery ends, and does not start again for the data sent so far */
+  socket->recovery_start_us = 0;
+  socket->recover = socket->seq_number;
+  /* The oldest segment goes out right away whatever the window, which
+     also re-arms the timer */
+  retransmit_now(socket, rq_front(socket));
+}
+/*
+ * Feeds a round trip time measurement to the estimator of RFC 6298.
+ */
+static void rtt_sample(microtcp_sock_t *socket, uint64_t rtt_us)
+{
+  if (socket->srtt_us == 0)
+  {
+    socket->srtt_us = rtt_us > 0 ? rtt_us : 1;
+    socket->rttvar_us = rtt_us / 2;
+  }
+  else
+  {
+    uint64_t delta = socket->srtt_us > rtt_us ? socket->srtt_us - rtt_us : rtt_us - socket->srtt_us;
+    socket->rttvar_us = (3 * socket->rttvar_us + delta) / 4;
+    socket->srtt_us = (7 * socket->srtt_us + rtt_us) / 8;
+  }
+  uint64_t rto = socket->srtt_us + 4 * socket->rttvar_us;
+  rto = rto < socket->rto_min_us ? socket->rto_min_us : rto;
+  socket->rto_us = rto > socket->rto_max_us ? socket->rto_max_us : rto;
+}
+/*
+ * Points words to the future_use fields of h that carry SACK blocks and
+ * returns how many they are.
+ */
+static size_t sack_words(microtcp_sock_t *socket, microtcp_header_t *h, uint32_t **words)
+{
+  size_t n = 0;
+  if (!(socket->options & MICROTCP_OPT_TIMESTAMPS))
+  {
+    words[n++] = &h->future_use0;
+    words[n++] = &h->future_use1;
+  }
+  words[n++] = &h->future_use2;
+  return n;
+}
+/*
+ * Updates the scoreboard with the SACK blocks of an ACK. Segments the
+ * receiver already holds leave the pipe and are never retransmitted. A
+ * segment is deemed lost once DUP_ACK_THRESHOLD segments above it have
+ * been SACKed, provided that at least one of them was sent after its last
+ * (re)transmission, so a retransmission is not declared lost again before
+ * it had a chance to arrive.
+ */
+static int on_sack_blocks(microtcp_sock_t *socket, microtcp_header_t *ack_header)
+{
+  uint32_t *words[MICROTCP_MAX_SACK_BLOCKS];
+  size_t n = sack_words(socket, ack_header, words);
+  int sacked = 0;
+  for (size_t b = 0; b < n; b++)
+  {
+    if (*words[b] == 0)
+    {
+      continue;
+    }
+    uint32_t start = ack_header->ack_number + ((*words[b] >> 16) << socket->snd_wscale);
+    uint32_t end = start + ((*words[b] & 0xffff) << socket->snd_wscale);
+    for (size_t i = 0; i < socket->rq_len; i++)
+    {
+      microtcp_segment_t *segment = &socket->retrans_queue[(socket->rq_head + i) % socket->rq_size];
+      if ((segment->flags & MICROTCP_SEG_SACKED) || seq_before(segment->seq_number, start) ||
+          seq_after(segment->seq_number + segment->data_len, end))
+      {
+        continue;
+      }
+      if (!(segment->flags & MICROTCP_SEG_LOST))
+      {
+        socket->pipe -= segment->data_len;
+      }
+      segment->flags = (segment->flags & ~MICROTCP_SEG_LOST) | MICROTCP_SEG_SACKED;
+      sacked = 1;
+    }
+  }
+  if (!sacked)
+  {
+    return 0;
+  }
+  int lost = 0;
+  uint32_t sacked_above = 0;
+  uint64_t delivered_us = 0;
+  for (size_t i = socket->rq_len; i-- > 0;)
+  {
+    microtcp_segment_t *segment = &socket->retrans_queue[(socket->rq_head + i) % socket->rq_size];
+    if (segment->flags & MICROTCP_SEG_SACKED)
+    {
+      sacked_above++;
+      delivered_us = segment->sent_us > delivered_us ? segment->sent_us : delivered_us;
+    }
+    else if (sacked_above >= MICROTCP_DUP_ACK_THRESHOLD && segment->sent_us < delivered_us &&
+             !(segment->flags & MICROTCP_SEG_LOST))
+    {
+      mark_lost(socket, segment);
+      lost++;
+    }
+  }
+  return lost;
+}
+static void on_new_ack(microtcp_sock_t *socket, const microtcp_header_t *ack_header)
+{
+  uint32_t ack = ack_header->ack_number;
+  uint64_t now = now_us();
+  uint64_t sample_sent_us = 0;
+  while (socket->rq_len > 0)
+  {
+    microtcp_segment_t *segment = rq_front(socket);
+    if (seq_after(segment->seq_number + segment->data_len, ack))
+    {
+      break;
+    }
+    if (!(segment->flags & (MICROTCP_SEG_LOST | MICROTCP_SEG_SACKED)))
+    {
+      socket->pipe -= segment->data_len;
+    }
+    /* Karn: the ACK of a retransmitted segment is ambiguous */
+    if (segment->retransmits == 0)
+    {
+      sample_sent_us = segment->sent_us;
+    }
+    rq_pop(socket);
+  }
+  uint64_t rtt_us = 0; // no sample
+  if ((socket->options & MICROTCP_OPT_TIMESTAMPS) && ack_header->future_use1 != 0)
+  {
+    /* The echoed timestamp tells which transmission is acknowledged,
+       retransmissions included */
+    rtt_us = (uint32_t)((uint32_t)now - ack_header->future_use1);
+    rtt_us = rtt_us > 0 ? rtt_us : 1;
+  }
+  else if (sample_sent_us != 0)
+  {
+    rtt_us = now - sample_sent_us > 0 ? now - sample_sent_us : 1;
+  }
+  if (rtt_us > 0)
+  {
+    rtt_sample(socket, rtt_us);
+  }
+  size_t acked = (uint32_t)(ack - (uint32_t)socket->snd_una);
+  socket->snd_una = ack;
+  socket->dup_acks = 0;
+  if (socket->rq_len > 0)
+  {
+    microtcp_timer_arm(socket_wheel(socket), &socket->rto_timer, now + socket->rto_us);
+  }
+  else
+  {
+    microtcp_timer_cancel(&socket->rto_timer);
+  }
+  if (socket->recovery_start_us == 0)
+  {
+    socket->cc->on_ack(socket, acked, rtt_us);
+  }
+  else if (seq_before(ack, socket->recover))
+  {
+    /* Partial ACK, the segment after it was lost too unless it has
+       already been resent during this recovery */
+    microtcp_segment_t *segment = rq_front(socket);
+    if (segment->sent_us < socket->recovery_start_us)
+    {
+      mark_lost(socket, segment);
+      retransmit_now(socket, segment);
+    }
+    if (!(socket->options & MICROTCP_OPT_SACK))
+    {
+      /* Deflate by the data that left the network, keep one segment
+         for the retransmission */
+      socket->cwnd = socket->cwnd > acked ? socket->cwnd - acked : 0;
+      socket->cwnd = socket->cwnd + (acked >= MICROTCP_MSS ? MICROTCP_MSS : 0);
+      socket->cwnd = socket->cwnd > MICROTCP_MSS ? socket->cwnd : MICROTCP_MSS;
+    }
+  }
+  else
+  {
+    /* Full ACK, every segment outstanding at the loss has arrived. Avoid
+       a burst if little data is in flight */
+    socket->recovery_start_us = 0;
+    socket->cwnd = socket->pipe + MICROTCP_MSS < socket->ssthresh ? socket->pipe + MICROTCP_MSS : socket->ssthresh;
+  }
+}
+/*
+ * Fast retransmit and fast recovery (RFC 5681, RFC 6582). The congestion
+ * control module reduces the window once for the whole loss event and
+ * the first hole is resent right away. Without SACK the window is inflated
+ * by the segments the duplicate ACKs report as delivered, with SACK these
+ * already leave pipe.
+ */
+static void enter_fast_recovery(microtcp_sock_t *socket)
+{
+  socket->recovery_start_us = now_us();
+  socket->recover = socket->seq_number;
+  socket->cc->on_loss(socket);
+  if (!(socket->options & MICROTCP_OPT_SACK))
+  {
+    socket->cwnd = socket->ssthresh + socket->dup_acks * MICROTCP_MSS;
+  }
+  microtcp_segment_t *segment = rq_front(socket);
+  mark_lost(socket, segment);
+  retransmit_now(socket, segment);
+}
+/*
+ * Reports the out of order data the receiver holds in the future_use words
+ * of the outgoing ACK. A block is its offset from ack_number and its
+ * length, 16 bits each, in units of the window scale so that it reaches
+ * as far as the window. Its ends are rounded inwards to whole units, it
+ * never claims a byte the receiver does not hold.
+ */
+static void add_sack_blocks(microtcp_sock_t *socket)
+{
+  uint32_t *words[MICROTCP_MAX_SACK_BLOCKS];
+  size_t max = sack_words(socket, &socket->header, words);
+  uint32_t shift = socket->rcv_wscale;
+  size_t n = 0;
+  for (size_t i = 0; i < socket->rcv_sack_len && n < max; i++)
+  {
+    uint32_t offset = socket->rcv_sack[i].start - (uint32_t)socket->ack_number;
+    uint32_t first = (uint32_t)(((uint64_t)offset + (1u << shift) - 1) >> shift);
+    uint32_t last = (uint32_t)(((uint64_t)offset + (socket->rcv_sack[i].end - socket->rcv_sack[i].start)) >> shift);
+    if (last <= first || first > 0xffff)
+    {
+      continue;
+    }
+    *words[n++] = first << 16 | (last - first > 0xffff ? 0xffff : last - first);
+  }
+}
+/*
+ * Room for more data: the receive buffer, less the data received in order
+ * that the application has not read yet.
+ */
+static size_t rcv_window(microtcp_sock_t *socket)
+{
+  return socket->curr_win_size > socket->buf_fill_level ? socket->curr_win_size - socket->buf_fill_level : 0;
+}
+/*
+ * Sends a cumulative ACK for everything received in order so far, with
+ * the window there is room for.
+ */
+static void send_data_ack(microtcp_sock_t *socket)
+{
+  socket->ack_pending = 0;
+  microtcp_timer_cancel(&socket->delack_timer);
+  fill_header(socket, 1 << 11);
+  socket->header.window = advertised_window(rcv_window(socket), socket->rcv_wscale);
+  socket->rcv_wnd_adv = (size_t)socket->header.window << socket->rcv_wscale;
+  add_timestamps(socket);
+  if (socket->options & MICROTCP_OPT_SACK)
+  {
+    add_sack_blocks(socket);
+  }
+  queue_datagram(socket, NULL, 0);
+}
+/* Handles an ACK of size bytes from the receiver */
+static void process_ack(microtcp_sock_t *socket, microtcp_header_t *ack_header, size_t size)
+{
+  if (size != sizeof(microtcp_header_t) || !correct_checksum_packet((const uint8_t *)ack_header, size) ||
+      !(ack_header->control & (1 << 11)))
+  {
+    return;
+  }
+  uint32_t ack = ack_header->ack_number;
+  if (socket->options & MICROTCP_OPT_TIMESTAMPS)
+  {
+    update_ts_recent(socket, ack_header);
+  }
+  /* Every ACK tells the room the receiver has, but a reordered old one */
+  int window_update = 0;
+  if (!seq_before(ack, socket->snd_una) && !seq_after(ack, socket->seq_number))
+  {
+    size_t window = (size_t)ack_header->window << socket->snd_wscale;
+    window_update = window != socket->flow_ctrl_win;
+    socket->flow_ctrl_win = window;
+  }
+  int lost = 0;
+  if (seq_after(ack, socket->snd_una) && !seq_after(ack, socket->seq_number))
+  {
+    on_new_ack(socket, ack_header);
+    if (socket->options & MICROTCP_OPT_SACK)
+    {
+      lost = on_sack_blocks(socket, ack_header);
+    }
+  }
+  else if (ack == (uint32_t)socket->snd_una && socket->rq_len > 0 && !window_update)
+  {
+    if (socket->options & MICROTCP_OPT_SACK)
+    {
+      lost = on_sack_blocks(socket, ack_header);
+    }
+    socket->dup_acks++;
+    if (socket->recovery_start_us != 0 && !(socket->options & MICROTCP_OPT_SACK))
+    {
+      socket->cwnd = socket->cwnd + MICROTCP_MSS; // another segment has left the network
+    }
+    else if (socket->dup_acks == MICROTCP_DUP_ACK_THRESHOLD)
+    {
+      lost = 1;
+    }
+  }
+  /* Data sent before the last loss event does not start another one */
+  if (lost && socket->recovery_start_us == 0 && socket->rq_len > 0 &&
+      !seq_before(socket->snd_una, socket->recover))
+  {
+    enter_fast_recovery(socket);
+  }
+}
+/*
+ * Starts sending a message of length bytes. The data is not copied, it
+ * has to stay in place until it is all acknowledged.
+ */
+static void send_start(microtcp_sock_t *socket, const uint8_t *data, size_t length)
+{
+  socket->snd_data = data;
+  socket->snd_length = length;
+  socket->snd_first = socket->seq_number;
+  socket->snd_una = socket->seq_number;
+  socket->pipe = 0;
+  socket->rq_head = 0;
+  socket->rq_len = 0;
+  socket->dup_acks = 0;
+  socket->recover = socket->snd_una;
+  socket->recovery_start_us = 0;
+  microtcp_timer_cancel(&socket->rto_timer);
+  microtcp_timer_cancel(&socket->persist_timer);
+}
+/* Whether all of the message being sent is acknowledged */
+static int send_done(microtcp_sock_t *socket)
+{
+  return (uint32_t)(socket->snd_una - socket->snd_first) >= socket->snd_length;
+}
+/*
+ * Repairs the losses first, then keeps the pipe full with new segments of
+ * the message, as far as the windows and pacing allow. A segment never
+ * goes beyond the window of the receiver, if it has no room left with
+ * nothing in flight the persist timer asks it when it has again.
+ */
+static void send_fill(microtcp_sock_t *socket)
+{
+  size_t window = socket->flow_ctrl_win < socket->cwnd ? socket->flow_ctrl_win : socket->cwnd;
+  size_t length = socket->snd_length;
+  size_t queued = (uint32_t)(socket->seq_number - socket->snd_first);
+  int no_room = 0;
+  while (!retransmit_lost(socket, window) && queued < length)
+  {
+    size_t size = length - queued < MICROTCP_MSS ? length - queued : MICROTCP_MSS;
+    if ((uint32_t)(socket->seq_number - socket->snd_una) + size > socket->flow_ctrl_win)
+    {
+      no_room = 1;
+      break;
+    }
+    if ((socket->pipe > 0 && socket->pipe + size > window) || paced(socket))
+    {
+      break;
+    }
+    microtcp_segment_t *segment = rq_push(socket);
+    segment->seq_number = socket->seq_number;
+    segment->data_len = size;
+    segment->data = socket->snd_data + queued;
+    segment->retransmits = 0;
+    segment->flags = 0;
+    transmit_segment(socket, segment);
+    socket->seq_number = socket->seq_number + size;
+    queued += size;
+  }
+  if (paced(socket))
+  {
+    microtcp_timer_arm(socket_wheel(socket), &socket->pace_timer, socket->next_send_us);
+  }
+  if (!no_room || (uint32_t)socket->seq_number != (uint32_t)socket->snd_una)
+  {
+    microtcp_timer_cancel(&socket->persist_timer);
+  }
+  else if (!microtcp_timer_armed(&socket->persist_timer))
+  {
+    socket->persist_backoff = 0;
+    microtcp_timer_arm(socket_wheel(socket), &socket->persist_timer, now_us() + socket->rto_us);
+  }
+  flush_tx(socket);
+}
+/*
+ * Processes the ACKs that have arrived, without waiting for any. Returns
+ * how many datagrams there were, or -1 on error.
+ */
+static int send_receive_acks(microtcp_sock_t *socket)
+{
+  uint8_t *datagrams[RX_MAX_DATAGRAMS];
+  size_t sizes[RX_MAX_DATAGRAMS];
+  int n = receive_batch(socket, MSG_DONTWAIT, datagrams, sizes);
+  if (n == -1)
+  {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+    {
+      return 0;
+    }
+    perror("recvmmsg");
+    return -1;
+  }
+  for (int i = 0; i < n; i++)
+  {
+    microtcp_header_t ack_header;
+    memcpy(&ack_header, datagrams[i], sizes[i] < sizeof(ack_header) ? sizes[i] : sizeof(ack_header));
+    process_ack(socket, &ack_header, sizes[i]);
+  }
+  return n;
+}
+/* When the sender has to act next without an ACK: a timer or pacing, 0 for never */
+static uint64_t send_wakeup(microtcp_sock_t *socket, uint64_t now)
+{
+  uint64_t wakeup = microtcp_wheel_next(socket_wheel(socket));
+  if (socket->pacing && socket->next_send_us > now &&
+      (wakeup == 0 || socket->next_send_us < wakeup))
+  {
+    wakeup = socket->next_send_us;
+  }
+  return wakeup;
+}
+/*
+ * Takes the message being sent as far as it goes without blocking: the
+ * ACKs that arrived, the timer and as many segments as may leave.
+ * Returns -1 on error.
+ */
+static int send_step(microtcp_sock_t *socket)
+{
+  int n;
+  do
+  {
+    n = send_receive_acks(socket);
+    if (n == -1)
+    {
+      return -1;
+    }
+    microtcp_wheel_advance(socket_wheel(socket), now_us());
+    send_fill(socket);
+  } while (n > 0 && !send_done(socket));
+  if (send_done(socket))
+  {
+    socket->snd_data = NULL;
+  }
+  return 0;
+}
+/*
+ * Bytes the send buffer has to hold on to: those the peer has not
+ * acknowledged, and the rest of a segment it acknowledged only in part.
+ */
+static size_t snd_held(microtcp_sock_t *socket)
+{
+  uint32_t keep = socket->rq_len > 0 ? rq_front(socket)->seq_number : (uint32_t)socket->snd_una;
+  return socket->snd_length - (uint32_t)(keep - socket->snd_first);
+}
+/*
+ * Makes room at the end of the send buffer for up to length more bytes,
+ * within MICROTCP_SNDBUF_LEN. The data it no longer holds on to goes,
+ * the buffer grows as needed, and the segments in flight follow their
+ * payload. Returns the room there is.
+ */
+static size_t snd_make_room(microtcp_sock_t *socket, size_t length)
+{
+  size_t held = snd_held(socket);
+  size_t acked = socket->snd_length - held;
+  size_t want = held + length < MICROTCP_SNDBUF_LEN ? held + length : MICROTCP_SNDBUF_LEN;
+  if (socket->snd_length + length <= socket->snd_copy_size || want <= held)
+  {
+    return socket->snd_copy_size - socket->snd_length;
+  }
+  uint8_t *old = socket->snd_copy + acked;
+  uint8_t *buffer = socket->snd_copy;
+  if (want > socket->snd_copy_size)
+  {
+    size_t size = socket->snd_copy_size * 2 > want ? socket->snd_copy_size * 2 : want;
+    size = size < MICROTCP_SNDBUF_LEN ? size : MICROTCP_SNDBUF_LEN;
+    buffer = alloc_buffer(size);
+    memcpy(buffer, old, held);
+    free(socket->snd_copy);
+    socket->snd_copy_size = size;
+  }
+  else
+  {
+    memmove(buffer, old, held);
+  }
+  for (size_t i = 0; i < socket->rq_len; i++)
+  {
+    microtcp_segment_t *segment = &socket->retrans_queue[(socket->rq_head + i) % socket->rq_size];
+    segment->data = buffer + (segment->data - old);
+  }
+  socket->snd_copy = buffer;
+  socket->snd_data = buffer;
+  socket->snd_first += acked;
+  socket->snd_length = held;
+  return socket->snd_copy_size - socket->snd_length;
+}
+/*
+ * microtcp_send() of a non-blocking socket. The data is copied to the end
+ * of the send buffer, so that the call returns once it is on its way, and
+ * fails with EAGAIN only while the buffer is full.
+ */
+static ssize_t send_nonblocking(microtcp_sock_t *socket, const void *buffer, size_t length)
+{
+  if (socket->snd_data != NULL && send_step(socket) == -1)
+  {
+    return -1;
+  }
+  if (length == 0)
+  {
+    return 0;
+  }
+  if (socket->snd_data == NULL)
+  {
+    send_start(socket, socket->snd_copy, 0);
+  }
+  size_t room = snd_make_room(socket, length);
+  if (room == 0)
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+  size_t size = length < room ? length : room;
+  memcpy(socket->snd_copy + socket->snd_length, buffer, size);
+  socket->snd_data = socket->snd_copy;
+  socket->snd_length += size;
+  if (send_step(socket) == -1)
+  {
+    return -1;
+  }
+  return size;
+}
+ssize_t microtcp_send(microtcp_sock_t *socket, const void *buffer,
+                      size_t length, int flags)
+{
+  if (socket->nonblock || (flags & MSG_DONTWAIT))
+  {
+    return send_nonblocking(socket, buffer, length);
+  }
+  send_start(socket, buffer, length);
+  microtcp_timer_wheel_t *wheel = socket_wheel(socket);
+  while (!send_done(socket))
+  {
+    send_fill(socket);
+
+    uint64_t now = now_us();
+    if (microtcp_wheel_advance(wheel, now) > 0)
+    {
+      continue;
+    }
+    /* Sleep until an ACK, the next paced segment or a timer, with
+       microsecond precision for pacing */
+    uint64_t wakeup = send_wakeup(socket, now);
+    uint64_t timeout = wakeup == 0 ? WAIT_FOREVER : wakeup > now ? wakeup - now : 0;
+    if ((socket->conn == NULL || socket->conn->len == 0) && wait_readable(socket->sd, timeout) == 0)
+    {
+      continue;
+    }
+    /* Everything that has arrived is processed before sending again */
+    if (send_receive_acks(socket) == -1)
+    {
+      disarm_sender_timers(socket);
+      return -1;
+    }
+  }
+  flush_tx(socket);
+  microtcp_timer_cancel(&socket->pace_timer);
+  socket->snd_data = NULL;
+  return length;
+}
+/*
+ * Copies between a linear buffer and the receive ring, from position pos
+ * on. Data never moves once stored, a gap is filled in place and the
+ * application reads from where the ring holds it.
+ */
+static void ring_write(uint8_t *ring, size_t ring_len, size_t pos, const uint8_t *src, size_t len)
+{
+  size_t first = len < ring_len - pos ? len : ring_len - pos;
+  memcpy(ring + pos, src, first);
+  memcpy(ring, src + first, len - first);
+}
+static void ring_read(const uint8_t *ring, size_t ring_len, size_t pos, uint8_t *dst, size_t len)
+{
+  size_t first = len < ring_len - pos ? len : ring_len - pos;
+  memcpy(dst, ring + pos, first);
+  memcpy(dst + first, ring, len - first);
+}
+/* Sequence number of the first byte the application has not read */
+static uint32_t rcv_read_seq(microtcp_sock_t *socket)
+{
+  return (uint32_t)socket->ack_number - socket->buf_fill_level;
+}
+/*
+ * Where the byte of sequence number seq is held in the ring, which has to
+ * be within its length of the first byte not read.
+ */
+static size_t ring_pos(microtcp_sock_t *socket, uint32_t seq)
+{
+  return (socket->rcv_head + (uint32_t)(seq - rcv_read_seq(socket))) % socket->recvbuf_len;
+}
+static microtcp_sack_block_t *ooo_find(microtcp_sock_t *socket, uint32_t seq)
+{
+  for (size_t i = 0; i < socket->ooo_len; i++)
+  {
+    if (!seq_before(seq, socket->ooo[i].start) && seq_before(seq, socket->ooo[i].end))
+    {
+      return &socket->ooo[i];
+    }
+  }
+  return NULL;
+}
+/*
+ * Records [start, end) as held in the ring, merging it with the ranges it
+ * overlaps or touches. Returns 0 if there is no room for another range.
+ */
+static int ooo_add_range(microtcp_sock_t *socket, uint32_t start, uint32_t end)
+{
+  size_t i = 0;
+  while (i < socket->ooo_len && seq_before(socket->ooo[i].end, start))
+  {
+    i++;
+  }
+  size_t j = i;
+  while (j < socket->ooo_len && !seq_after(socket->ooo[j].start, end))
+  {
+    start = seq_before(socket->ooo[j].start, start) ? socket->ooo[j].start : start;
+    end = seq_after(socket->ooo[j].end, end) ? socket->ooo[j].end : end;
+    j++;
+  }
+  if (i == j && socket->ooo_len == MICROTCP_MAX_OOO_RANGES)
+  {
+    return 0;
+  }
+  memmove(&socket->ooo[i + 1], &socket->ooo[j], (socket->ooo_len - j) * sizeof(microtcp_sack_block_t));
+  socket->ooo[i].start = start;
+  socket->ooo[i].end = end;
+  socket->ooo_len = socket->ooo_len - (j - i) + 1;
+  return 1;
+}
+/* Adds the range to the blocks to report, unless it is there already */
+static size_t sack_block_add(microtcp_sack_block_t *blocks, size_t n, const microtcp_sack_block_t *range)
+{
+  for (size_t i = 0; i < n; i++)
+  {
+    if (blocks[i].start == range->start)
+    {
+      return n;
+    }
+  }
+  blocks[n] = *range;
+  return n + 1;
+}
+/*
+ * Refreshes the SACK blocks to report: the range right above the hole at
+ * ack_number first, where the sender has to repair next, then the range
+ * holding the most recently received segment, then the ones reported
+ * before that still exist.
+ */
+static void update_rcv_sack(microtcp_sock_t *socket, uint32_t newest_seq, int have_newest)
+{
+  microtcp_sack_block_t blocks[MICROTCP_MAX_SACK_BLOCKS];
+  size_t n = 0;
+  if (socket->ooo_len > 0)
+  {
+    n = sack_block_add(blocks, n, &socket->ooo[0]);
+  }
+  microtcp_sack_block_t *range = have_newest ? ooo_find(socket, newest_seq) : NULL;
+  if (range != NULL && n < MICROTCP_MAX_SACK_BLOCKS)
+  {
+    n = sack_block_add(blocks, n, range);
+  }
+  for (size_t i = 0; i < socket->rcv_sack_len && n < MICROTCP_MAX_SACK_BLOCKS; i++)
+  {
+    range = ooo_find(socket, socket->rcv_sack[i].start);
+    if (range != NULL)
+    {
+      n = sack_block_add(blocks, n, range);
+    }
+  }
+  memcpy(socket->rcv_sack, blocks, n * sizeof(microtcp_sack_block_t));
+  socket->rcv_sack_len = n;
+}
+/*
+ * Stores a segment that arrived ahead of ack_number, if it fits in the
+ * receive buffer.
+ */
+static void ooo_store(microtcp_sock_t *socket, uint32_t seq, const uint8_t *payload, uint32_t len)
+{
+  if ((uint32_t)(seq + len - rcv_read_seq(socket)) > socket->recvbuf_len)
+  {
+    return;
+  }
+  ring_write(socket->recvbuf, socket->recvbuf_len, ring_pos(socket, seq), payload, len);
+  if (ooo_add_range(socket, seq, seq + len))
+  {
+    update_rcv_sack(socket, seq, 1);
+  }
+}
+/*
+ * Advances ack_number past the out of order data that became in order,
+ * which stays where it is in the ring. Returns the number of bytes.
+ */
+static size_t ooo_deliver(microtcp_sock_t *socket)
+{
+  size_t delivered = 0;
+  while (socket->ooo_len > 0 && !seq_after(socket->ooo[0].start, socket->ack_number))
+  {
+    uint32_t ack = socket->ack_number;
+    if (seq_after(socket->ooo[0].end, ack))
+    {
+      delivered += socket->ooo[0].end - ack;
+      socket->ack_number = socket->ooo[0].end;
+    }
+    socket->ooo_len--;
+    memmove(&socket->ooo[0], &socket->ooo[1], socket->ooo_len * sizeof(microtcp_sack_block_t));
+  }
+  if (delivered > 0)
+  {
+    update_rcv_sack(socket, 0, 0);
+  }
+  return delivered;
+}
+/*
+ * A round trip as the receiver sees it, from when it stamped the ACK whose
+ * timestamp a segment echoes. Samples are inflated whenever the sender had
+ * nothing to send, so a lower one is taken at once and a higher one only
+ * slowly.
+ */
+static void rcv_rtt_sample(microtcp_sock_t *socket, const microtcp_header_t *h)
+{
+  if (!(socket->options & MICROTCP_OPT_TIMESTAMPS) || h->future_use1 == 0)
+  {
+    return;
+  }
+  uint64_t rtt_us = (uint32_t)((uint32_t)now_us() - h->future_use1);
+  rtt_us = rtt_us > 0 ? rtt_us : 1;
+  if (socket->rcv_rtt_us == 0 || rtt_us < socket->rcv_rtt_us)
+  {
+    socket->rcv_rtt_us = rtt_us;
+  }
+  else
+  {
+    socket->rcv_rtt_us = (7 * socket->rcv_rtt_us + rtt_us) / 8;
+  }
+}
+/*
+ * Receive buffer autotuning, after tcp_rcv_space_adjust() of Linux. Once
+ * per round trip the delivery rate of the last one gives the
+ * bandwidth-delay product, and the buffer grows to twice that, so that the
+ * window stays ahead of a sender in slow start. What the ring holds moves
+ * to the front of the new one.
+ */
+static void rcv_space_adjust(microtcp_sock_t *socket, size_t delivered)
+{
+  uint64_t now = now_us();
+  if (socket->rcv_space_start_us == 0)
+  {
+    socket->rcv_space_start_us = now;
+  }
+  socket->rcv_space_bytes += delivered;
+  uint64_t rtt_us = socket->rcv_rtt_us > 0 ? socket->rcv_rtt_us : socket->srtt_us;
+  uint64_t elapsed = now - socket->rcv_space_start_us;
+  if (!socket->rcv_autotune || rtt_us == 0 || elapsed < rtt_us)
+  {
+    return;
+  }
+  size_t target = (size_t)(2 * socket->rcv_space_bytes * rtt_us / elapsed);
+  target = target < MICROTCP_AUTOTUNE_MAX_RECVBUF ? target : MICROTCP_AUTOTUNE_MAX_RECVBUF;
+  socket->rcv_space_start_us = now;
+  socket->rcv_space_bytes = 0;
+  if (target <= socket->recvbuf_len)
+  {
+    return;
+  }
+  size_t grow = target - socket->recvbuf_len;
+  if (__atomic_add_fetch(&recvbuf_mem, grow, __ATOMIC_RELAXED) >
+      __atomic_load_n(&recvbuf_mem_limit, __ATOMIC_RELAXED))
+  {
+    __atomic_sub_fetch(&recvbuf_mem, grow, __ATOMIC_RELAXED);
+    return;
+  }
+  uint8_t *recvbuf = alloc_buffer(target);
+  uint32_t end = socket->ooo_len > 0 ? socket->ooo[socket->ooo_len - 1].end : (uint32_t)socket->ack_number;
+  ring_read(socket->recvbuf, socket->recvbuf_len, socket->rcv_head, recvbuf,
+            (uint32_t)(end - rcv_read_seq(socket)));
+  free(socket->recvbuf);
+  socket->recvbuf = recvbuf;
+  socket->recvbuf_len = target;
+  socket->rcv_head = 0;
+  socket->curr_win_size = target;
+}
+/*
+ * Takes a data segment of size bytes into the receive buffer, if it fits,
+ * and ACKs it, possibly together with the ones after if it is a full
+ * segment in order.
+ */
+static void recv_segment(microtcp_sock_t *socket, const uint8_t *datagram, size_t size)
+{
+  microtcp_header_t header_received;
+  memcpy(&header_received, datagram, sizeof(microtcp_header_t));
+  int flag_checksum = size > 32 && correct_checksum_packet(datagram, size);
+  size_t bytes_recv = size - 32;
+  uint32_t offset = header_received.seq_number - (uint32_t)socket->ack_number;
+  int delay = 0;
+  if (flag_checksum == 1 && !paws_reject(socket, &header_received) &&
+      socket->buf_fill_level + offset + bytes_recv <= socket->recvbuf_len)
+  {
+    socket->packets_received++;
+    socket->bytes_received += bytes_recv;
+    if (offset == 0)
+    {
+      if (socket->options & MICROTCP_OPT_TIMESTAMPS)
+      {
+        update_ts_recent(socket, &header_received);
+      }
+      rcv_rtt_sample(socket, &header_received);
+      ring_write(socket->recvbuf, socket->recvbuf_len, ring_pos(socket, header_received.seq_number),
+                 datagram + sizeof(microtcp_header_t), bytes_recv);
+      socket->ack_number = header_received.seq_number + bytes_recv;
+      /* Not if it filled a gap, the sender learns of that at once */
+      delay = socket->ooo_len == 0 && bytes_recv == MICROTCP_MSS &&
+              !(header_received.control & MICROTCP_ACK_NOW);
+      size_t delivered = ooo_deliver(socket);
+      socket->buf_fill_level += bytes_recv + delivered;
+      rcv_space_adjust(socket, bytes_recv + delivered);
+    }
+    else
+    {
+      ooo_store(socket, header_received.seq_number, datagram + sizeof(microtcp_header_t), bytes_recv);
+    }
+  }
+  if (delay && ++socket->ack_pending < socket->ack_ratio)
+  {
+    if (!microtcp_timer_armed(&socket->delack_timer))
+    {
+      microtcp_timer_arm(socket_wheel(socket), &socket->delack_timer, now_us() + MICROTCP_DELACK_US);
+    }
+    return;
+  }
+  /* Cumulative ACK, a duplicate one if the segment was not the expected */
+  send_data_ack(socket);
+}
+/*
+ * Takes the datagrams of a receive. The FIN of the peer is only noted, it
+ * is answered once the data before it has all been read.
+ */
+static void recv_batch(microtcp_sock_t *socket, uint8_t **datagrams, size_t *sizes, int n)
+{
+  for (int i = 0; i < n; i++)
+  {
+    if (sizes[i] != sizeof(microtcp_header_t))
+    {
+      recv_segment(socket, datagrams[i], sizes[i]);
+    }
+    else if (!socket->is_client)
+    {
+      microtcp_header_t tmp_header;
+      memcpy(&tmp_header, datagrams[i], sizeof(tmp_header));
+      if (correct_checksum(tmp_header) && (tmp_header.control & (1 << 14)) &&
+          (tmp_header.control & (1 << 11)) && tmp_header.seq_number == (uint32_t)socket->ack_number)
+      {
+        socket->rcv_fin = 1;
+      }
+    }
+  }
+}
+/* The peer closed the connection and all the data before its FIN was read */
+static int recv_fin(microtcp_sock_t *socket)
+{
+  socket->ack_number++;
+  socket->state = CLOSING_BY_PEER;
+  return server_shutdown(socket);
+}
+/*
+ * Hands out up to length bytes of the data received in order. A peer that
+ * was last told of a window less than half of the one there is now learns
+ * at once that it grew, instead of from its next ACK or probe.
+ */
+static size_t rcv_dequeue(microtcp_sock_t *socket, uint8_t *buffer, size_t length)
+{
+  size_t size = socket->buf_fill_level < length ? socket->buf_fill_level : length;
+  ring_read(socket->recvbuf, socket->recvbuf_len, socket->rcv_head, buffer, size);
+  socket->rcv_head = (socket->rcv_head + size) % socket->recvbuf_len;
+  socket->buf_fill_level -= size;
+  size_t window = rcv_window(socket);
+  if (window >= MICROTCP_MSS && window >= 2 * socket->rcv_wnd_adv)
+  {
+    send_data_ack(socket);
+    flush_tx(socket);
+  }
+  return size;
+}
+/*
+ * Processes the datagrams that have arrived for a non-blocking receive,
+ * without waiting for any. The FIN of the peer is answered once the
+ * application has read everything before it. Returns -1 on error.
+ */
+static int recv_step(microtcp_sock_t *socket)
+{
+  while (socket->state == ESTABLISHED)
+  {
+    if (socket->rcv_fin && socket->buf_fill_level == 0)
+    {
+      recv_fin(socket);
+      return 0;
+    }
+    uint8_t *datagrams[RX_MAX_DATAGRAMS];
+    size_t sizes[RX_MAX_DATAGRAMS];
+    int n = receive_batch(socket, MSG_DONTWAIT, datagrams, sizes);
+    if (n == -1)
+    {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    }
+    recv_batch(socket, datagrams, sizes, n);
+    flush_tx(socket);
+    if (socket->ooo_len > 0)
+    {
+      microtcp_timer_arm(socket_wheel(socket), &socket->ack_timer, now_us() + MICROTCP_ACK_TIMEOUT_US);
+    }
+    else
+    {
+      microtcp_timer_cancel(&socket->ack_timer);
+    }
+  }
+  return 0;
+}
+/* microtcp_recv() of a non-blocking socket */
+static ssize_t recv_nonblocking(microtcp_sock_t *socket, void *buffer, size_t length)
+{
+  if (recv_step(socket) == -1)
+  {
+    return -1;
+  }
+  if (socket->state == CLOSED)
+  {
+    return 0;
+  }
+  if (socket->buf_fill_level == 0)
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+  return rcv_dequeue(socket, buffer, length);
+}
+/*
+ * The retransmission timer expired, the oldest segment goes again along
+ * with whatever the window then lets out.
+ */
+static void on_rto_timer(microtcp_timer_t *timer)
+{
+  microtcp_sock_t *socket = TIMER_SOCKET(timer, rto_timer);
+  on_retransmission_timeout(socket, now_us());
+  send_fill(socket);
+}
+/* Pacing lets the next segment leave */
+static void on_pace_timer(microtcp_timer_t *timer)
+{
+  microtcp_sock_t *socket = TIMER_SOCKET(timer, pace_timer);
+  if (socket->snd_data != NULL)
+  {
+    send_fill(socket);
+  }
+}
+/* The peer went silent while data is missing, it may be missing our last ACK */
+static void on_ack_timer(microtcp_timer_t *timer)
+{
+  microtcp_sock_t *socket = TIMER_SOCKET(timer, ack_timer);
+  send_data_ack(socket);
+  flush_tx(socket);
+  microtcp_timer_arm(socket_wheel(socket), timer, now_us() + MICROTCP_ACK_TIMEOUT_US);
+}
+/* No more segments came to share the held back ACK */
+static void on_delack_timer(microtcp_timer_t *timer)
+{
+  microtcp_sock_t *socket = TIMER_SOCKET(timer, delack_timer);
+  send_data_ack(socket);
+  flush_tx(socket);
+}
+/*
+ * The receiver has no room for the next segment. It is sent the byte
+ * before snd_una again, which it already has and answers right away with
+ * its window, at intervals that back off like the retransmission timer.
+ */
+static void on_persist_timer(microtcp_timer_t *timer)
 {
-  struct timeval timeout;
-  timeout.tv_sec = 0;
-  timeout.tv_usec =
-      MICROTCP_ACK_TIMEOUT_US;
-  if (
-      setsockopt(receive_socket, SOL_SOCKET,
-                 SO_RCVTIMEO, &timeout,
-                 sizeof(struct timeval)) < 0)
+  static const uint8_t probe = 0;
+  microtcp_sock_t *socket = TIMER_SOCKET(timer, persist_timer);
+  if (socket->snd_data == NULL)
   {
-    perror(" setsockopt");
+    return;
   }
+  fill_header(socket, MICROTCP_ACK_NOW);
+  socket->header.seq_number = socket->snd_una - 1;
+  socket->header.data_len = 1;
+  add_timestamps(socket);
+  queue_datagram(socket, &probe, 1);
+  flush_tx(socket);
+  uint64_t interval = socket->rto_us << (socket->persist_backoff < 16 ? socket->persist_backoff : 16);
+  interval = interval < socket->rto_max_us ? interval : socket->rto_max_us;
+  socket->persist_backoff++;
+  microtcp_timer_arm(socket_wheel(socket), timer, now_us() + interval);
 }
-ssize_t microtcp_send(microtcp_sock_t *socket, const void *buffer,
-                      size_t length, int flags)
+/*
+ * Our FIN went unanswered. It is repeated until MICROTCP_FIN_RETRIES,
+ * then the timer stays disarmed and the teardown gives up on the peer.
+ */
+static void on_close_timer(microtcp_timer_t *timer)
 {
-  int bytes_sent = 0;
-  uint32_t length_order = htonl(length);
-  int remaining = length;
-  int data_sent = 0;
-  int b_sent;
-  int start, end;
-  int size;
-  int new_start = -1;
-  int current_seq = socket->seq_number;
-  int duplicate_ack = 0;
-  uint32_t ack_retransmit = 0;
-  struct sockaddr *addr_to_send;
-  socklen_t addr_len;
-  if (socket->sd == client_sd)
+  microtcp_sock_t *socket = TIMER_SOCKET(timer, close_timer);
+  if (socket->close_retries == MICROTCP_FIN_RETRIES)
   {
-    addr_to_send = (struct sockaddr *)server_address;
-    addr_len = server_address_len;
-    b_sent = sendto(socket->sd, &length_order, sizeof(length_order), 0, (struct sockaddr *)server_address, server_address_len);
+    return;
   }
-  else
+  socket->close_retries++;
+  /* The FIN is the segment before seq_number */
+  socket->seq_number--;
+  create_header(socket, (1 << 11) | (1 << 14));
+  socket->seq_number++;
+  socklen_t addr_len;
+  struct sockaddr *addr_to_send = peer_address(socket, &addr_len);
+  sendto(socket->sd, &socket->header, sizeof(microtcp_header_t), 0, addr_to_send, addr_len);
+  microtcp_timer_arm(socket_wheel(socket), timer, now_us() + socket->rto_us);
+}
+static void init_timers(microtcp_sock_t *socket)
+{
+  microtcp_timer_init(&socket->rto_timer, on_rto_timer);
+  microtcp_timer_init(&socket->pace_timer, on_pace_timer);
+  microtcp_timer_init(&socket->ack_timer, on_ack_timer);
+  microtcp_timer_init(&socket->delack_timer, on_delack_timer);
+  microtcp_timer_init(&socket->persist_timer, on_persist_timer);
+  microtcp_timer_init(&socket->close_timer, on_close_timer);
+}
+/* Waits for an answer to our FIN, retrying the given number of times less */
+static void start_close_timer(microtcp_sock_t *socket, uint32_t retries)
+{
+  socket->close_retries = retries;
+  microtcp_timer_arm(socket_wheel(socket), &socket->close_timer, now_us() + socket->rto_us);
+}
+/*
+ * Sleeps until a datagram arrives for the socket or a timer of its wheel
+ * is due, then runs the timers that are.
+ */
+static void wait_event(microtcp_sock_t *socket)
+{
+  microtcp_timer_wheel_t *wheel = socket_wheel(socket);
+  uint64_t now = now_us();
+  uint64_t next = microtcp_wheel_next(wheel);
+  if (socket->conn == NULL || socket->conn->len == 0)
   {
-    addr_to_send = (struct sockaddr *)server_address;
-    addr_len = server_address_len;
-    b_sent = sendto(socket->sd, &length_order, sizeof(length_order), 0, (struct sockaddr *)client_address, client_address_len);
+    wait_readable(socket->sd, next == 0 ? WAIT_FOREVER : next > now ? next - now : 0);
   }
-  //printf("\nsent:%d\n", b_sent);
-  while (data_sent < length)
+  microtcp_wheel_advance(wheel, now_us());
+}
+/* Waits until the data in the send buffer is all acknowledged */
+static void send_drain(microtcp_sock_t *socket)
+{
+  while (socket->snd_data != NULL && socket->state == ESTABLISHED)
   {
-    int min_temp = flow_ctrl_win < socket->cwnd ? flow_ctrl_win : socket->cwnd;
-    int bytes_to_send = min_temp < remaining ? min_temp : remaining;
-    if(bytes_to_send==0)
+    if (send_step(socket) == -1)
     {
-      perror("bytes-send");
-      exit(0);
+      return;
     }
-    int chunks = bytes_to_send / MICROTCP_MSS;
-    int *check_size = malloc(chunks * sizeof(int));
-      for (int i = 0; i < chunks; i++)
-      {
-        size = MICROTCP_MSS;
-        start = i * MICROTCP_MSS;
-        if (new_start != -1)
-        {
-          duplicate_ack = 0;
-          start = new_start;
-          socket->seq_number = ack_retransmit;
-          bytes_sent = start;
-    //      printf("\nbytes_send%d\n", bytes_sent);
-        }
-        if (i * MICROTCP_MSS < new_start)
-        {
-          continue;
-        }
-        else
-        {
-          new_start = -1;
-        }
-        create_header(socket, 0);
-
-        socket->seq_number = socket->seq_number + size;
-        size_t final_size = sizeof(microtcp_header_t) + size;
-        check_size[i] = size;
-        uint8_t *temp_buffer = (uint8_t *)malloc(final_size * sizeof(uint8_t));
-        if (temp_buffer == NULL)
-        {
-          perror("Memory allocation failed");
-          exit(EXIT_FAILURE);
-        }
-        memcpy(temp_buffer, &header, sizeof(microtcp_header_t));
-      //  printf("header_sent:\n");
-       // print_header(&header);
-        memcpy(temp_buffer + sizeof(microtcp_header_t), buffer + start, size);
-        add_checksum(temp_buffer, final_size);
-        int chech;
-        memcpy(&chech, temp_buffer + 28, 4);
-       // printf("\n %d\n", chech);
-        bytes_sent += sendto(socket->sd, temp_buffer, final_size, 0, addr_to_send, addr_len);
-        bytes_sent -= 32;
-      //  flow_ctrl_win -= bytes_sent;
-        free(temp_buffer);
-      }
-      if (bytes_to_send % MICROTCP_MSS)
-      {
-        start = chunks * MICROTCP_MSS;
-        size = bytes_to_send % MICROTCP_MSS;
-        check_size[chunks] = size;
-        chunks++;
-        uint8_t *temp_buffer = (uint8_t *)malloc(size + sizeof(microtcp_header_t));
-        if (temp_buffer == NULL)
-        {
-        }
-        else
-        {
-          create_header(socket, 0);
-          socket->seq_number = socket->seq_number + size;
-          memcpy(temp_buffer, &header, sizeof(microtcp_header_t));
-        //  printf("header_sent:\n");
-         // print_header(&header);
-          memcpy(temp_buffer + sizeof(microtcp_header_t), buffer + start, size);
-          add_checksum(temp_buffer, size + sizeof(microtcp_header_t));
-          bytes_sent += sendto(socket->sd, temp_buffer, bytes_to_send % MICROTCP_MSS + sizeof(microtcp_header_t), 0, addr_to_send, addr_len);
-          bytes_sent -= 32;
-        //  flow_ctrl_win-= bytes_sent;
-          free(temp_buffer);
-        }
-      }
-    for (int i = 0; i < chunks; i++)
+    if (socket->snd_data != NULL)
     {
-      microtcp_header_t header_received;
-      int bytes_received;
-      set_timeout(socket->sd);
-      bytes_received = recvfrom(socket->sd, &header_received, sizeof(microtcp_header_t), 0, (struct sockaddr *)server_address, &server_address_len);
-      if (bytes_received == -1)
-      {
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
-        {
-          socket->ssthresh = socket->cwnd / 2;
-          socket->cwnd = MICROTCP_MSS < socket->ssthresh ? MICROTCP_MSS : socket->ssthresh;
-          duplicate_ack = 0;
-          i = -1;
-          data_sent = 0;
-          remaining = length;
-          bytes_sent = 0;
-          continue;
-        }
-      }
-      else
-      {
-       // flow_ctrl_win = header_received.window;
-        if (socket->cwnd >= socket->ssthresh && i == 0) // congestion avoidance
-        {
-          socket->cwnd = socket->cwnd + MICROTCP_MSS;
-        }
-        if (socket->cwnd < socket->ssthresh) // slow start
-        {
-          socket->cwnd = socket->cwnd + MICROTCP_MSS;
-        }
-        if (current_seq + check_size[i] == header_received.ack_number) // check correct seq number in order
-        {
-          current_seq = header_received.ack_number;
-        }
-        else // out of order
-        {
-          ack_retransmit = header_received.ack_number;
-          duplicate_ack++;
-        }
-        if (duplicate_ack > 0 && i == chunks - 1)
-        {
-          socket->ssthresh = socket->cwnd / 2;
-          socket->cwnd = socket->cwnd / 2 + 1;
-          new_start = start - (duplicate_ack - 1) * (MICROTCP_MSS);
-        }
-      }
-     // printf("duplicate:%d\n", duplicate_ack);
-     // printf("header_received:\n");
-     // print_header(&header_received);
+      wait_event(socket);
     }
-    if (duplicate_ack != 0)
+  }
+  microtcp_timer_cancel(&socket->pace_timer);
+}
+/*
+ * Leaves the wheel without timers of the receiver. Nothing advances it
+ * until the application calls again, an ACK held back goes out now.
+ */
+static void recv_blocking_done(microtcp_sock_t *socket)
+{
+  microtcp_timer_cancel(&socket->ack_timer);
+  if (microtcp_timer_armed(&socket->delack_timer))
+  {
+    send_data_ack(socket);
+    flush_tx(socket);
+  }
+}
+/*
+ * microtcp_recv() of a blocking socket that is established, which waits
+ * only while no data has been received in order.
+ */
+static ssize_t recv_blocking(microtcp_sock_t *socket, void *buffer, size_t length, int flags)
+{
+  microtcp_timer_wheel_t *wheel = socket_wheel(socket);
+  while (socket->buf_fill_level == 0 && !socket->rcv_fin)
+  {
+    uint8_t *datagrams[RX_MAX_DATAGRAMS];
+    size_t sizes[RX_MAX_DATAGRAMS];
+    /* The sender retransmits on its own, the ACK timer repeats where we
+       are if it goes silent */
+    microtcp_timer_arm(wheel, &socket->ack_timer, now_us() + MICROTCP_ACK_TIMEOUT_US);
+    int n = receive_batch(socket, flags | MSG_DONTWAIT, datagrams, sizes);
+    while (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
     {
-      remaining -= bytes_to_send - (duplicate_ack - 1) * MICROTCP_MSS - bytes_sent % MICROTCP_MSS;
-      data_sent += bytes_to_send - (duplicate_ack - 1) * MICROTCP_MSS - bytes_sent % MICROTCP_MSS;
+      wait_event(socket);
+      n = receive_batch(socket, flags | MSG_DONTWAIT, datagrams, sizes);
     }
-    else
+    if (n == -1)
     {
-
-      remaining -= bytes_to_send;
-      data_sent += bytes_to_send;
+      perror("recvmmsg failed");
+      recv_blocking_done(socket);
+      return -1;
     }
-    // free(duplicate_ack_buffer);
+    recv_batch(socket, datagrams, sizes, n);
+    flush_tx(socket);
   }
-  return bytes_sent;
+  recv_blocking_done(socket);
+  if (socket->buf_fill_level == 0)
+  {
+    return recv_fin(socket);
+  }
+  return rcv_dequeue(socket, buffer, length);
 }
 ssize_t microtcp_recv(microtcp_sock_t *socket, void *buffer, size_t length,
                       int flags)
 {
+  if (socket->nonblock)
+  {
+    return recv_nonblocking(socket, buffer, length);
+  }
+  if (socket->state == ESTABLISHED)
+  {
+    return recv_blocking(socket, buffer, length, flags);
+  }
 
-  int bytes_recv = 0, total = 1;
-  struct sockaddr_in *tmp = malloc(sizeof(struct sockaddr_in));
+  /* The teardown, which waits for the answers of the peer */
+  int total = 1;
+  struct sockaddr_in tmp;
   microtcp_header_t tmp_header;
   int bytes_read;
   socklen_t temp_len = sizeof(tmp); // Initialize the length
   memset(&tmp, 0, sizeof(tmp));     // Initialize the sockaddr_in structure
 
-  bytes_read = recvfrom(socket->sd, buffer, length, flags, (struct sockaddr *)tmp, &temp_len);
-
-  if (bytes_read == -1)
+  for (;;)
   {
-  //  printf("recvfrom failed with errno %d: %s\n", errno, strerror(errno));
-    return -1; // Instead of exiting, return -1 to indicate an error
+    bytes_read = recv_datagram(socket, buffer, length, flags | MSG_DONTWAIT, (struct sockaddr *)&tmp, &temp_len);
+
+    if (bytes_read == -1)
+    {
+      /* Only as long as the peer is waited for */
+      if ((errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) &&
+          microtcp_timer_armed(&socket->close_timer))
+      {
+        wait_event(socket);
+        continue;
+      }
+    //  printf("recvfrom failed with errno %d: %s\n", errno, strerror(errno));
+      return -1; // Instead of exiting, return -1 to indicate an error
+    }
+    if (bytes_read == 32)
+    {
+      memcpy(&tmp_header, buffer, 32);
+      if (!(tmp_header.control & (1 << 14)) && tmp_header.ack_number != (uint32_t)socket->seq_number)
+      {
+        /* A late ACK of data, not the answer to our FIN */
+        continue;
+      }
+      break;
+    }
+    /* A retransmission of data already delivered, its ACK got lost */
+    send_data_ack(socket);
+    flush_tx(socket);
   }
 
   if (bytes_read == 32)
@@ -447,29 +2302,24 @@ ssize_t microtcp_recv(microtcp_sock_t *socket, void *buffer, size_t length,
     }
     if (tmp_header.control & (1 << 14) && tmp_header.control & (1 << 11))
     {
-      if (socket->sd ==
-          server_sd) // server
+      if (!socket->is_client) // server
       {
         socket->ack_number = tmp_header.seq_number + 1; // ALLAGH
         socket->state = CLOSING_BY_PEER;
         int bytes = server_shutdown(socket);
         return bytes;
       }
-      else if (socket->sd == client_sd) // client receive_fin_ack
+      else // client receive_fin_ack
       {
         socket->ack_number = tmp_header.seq_number + 1;
       }
-      else
-      {
-        perror("wrong address 280");
-      }
     }
     else if (tmp_header.control & (1 << 11))
     {
-      if (socket->sd == server_sd) // server receive ack
+      if (!socket->is_client) // server receive ack
       {
-        if ((tmp_header.ack_number != socket->seq_number) ||
-            (tmp_header.seq_number != socket->ack_number))
+        if ((tmp_header.ack_number != (uint32_t)socket->seq_number) ||
+            (tmp_header.seq_number != (uint32_t)socket->ack_number))
         {
           perror("not end:294");
         }
@@ -478,113 +2328,54 @@ ssize_t microtcp_recv(microtcp_sock_t *socket, void *buffer, size_t length,
           return -1;
         }
       }
-      else if (socket->sd == client_sd) // client receive ack
+      else // client receive ack
       {
-        if (tmp_header.ack_number != socket->seq_number)
+        if (tmp_header.ack_number != (uint32_t)socket->seq_number)
         {
           perror("Wrong ack number (client receive_ack)");
         }
       }
-      else
-      {
-        perror("wrong address:304");
-      }
     }
   }
-  else
+  return total;
+}
+/* The smallest shift that fits a window into the 16 bits of the header */
+static uint32_t window_scale(size_t window)
+{
+  uint32_t shift = 0;
+  while (shift < MICROTCP_MAX_WSCALE && (window >> shift) > 0xffff)
   {
-    // Inside microtcp_recv
-    if (bytes_read == 4)
-    {
-      temp_size = malloc(4);
-      total--;
-      if (temp_size == NULL)
-      {
-        perror("Memory allocation failed");
-        exit(EXIT_FAILURE);
-      }
-      memcpy(temp_size, buffer, 4);
-      *(uint32_t *)temp_size = ntohl(*(uint32_t *)temp_size);
-      //printf("\nData size to receive: %d\n", *(int *)temp_size); // Debugging
-    }
-    int number_loops = *(int *)temp_size / MICROTCP_MSS;
-    number_loops += (*(int *)temp_size % MICROTCP_MSS) != 0 ? 1 : 0;
-    int counter_duplicate = 0;
-    for (int i = 0; i < number_loops; i++)
-    {
-      temp_buffer_recv = malloc(MICROTCP_MSS + sizeof(microtcp_header_t));
-      if (temp_buffer_recv == NULL)
-      {
-        perror("Memory allocation failed");
-        exit(EXIT_FAILURE);
-      }
-      struct sockaddr_in received_tmp;
-      socklen_t received_tmp_len = sizeof(received_tmp);
-      memset(&received_tmp, 0, sizeof(received_tmp));
-      set_timeout(socket->sd);
-      bytes_recv = recvfrom(socket->sd, temp_buffer_recv, MICROTCP_MSS + sizeof(microtcp_header_t), flags, (struct sockaddr *)&received_tmp, &received_tmp_len);
-      socket->curr_win_size-=bytes_recv-32;  
-      if (bytes_recv == -1)
-      {
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
-        {
-          perror("timeout");
-          i = -1;
-          total = 0;
-          counter_duplicate = 0;
-          continue;
-        }
-        else
-        {
-          perror("recvfrom failed");
-          free(temp_buffer_recv);
-          break;
-        }
-      }
-      microtcp_header_t header_received;
-      uint8_t *smallBuffer = malloc(bytes_recv);
-      memcpy(smallBuffer, temp_buffer_recv, bytes_recv);
-      memcpy(&header_received, temp_buffer_recv, sizeof(microtcp_header_t));
-     // printf("\n");
-      //printf("header received:\n");
-      //print_header(&header_received);
-      //printf("\n");
-      uint8_t *payload = malloc(MICROTCP_MSS);
-      int flag_checksum = correct_checksum_packet(smallBuffer, bytes_recv);
-      //printf("checksum flag %d , bytes recv : %d\n", flag_checksum, bytes_recv);
-      if (header_received.seq_number == socket->ack_number && flag_checksum == 1)
-      {
-        bytes_recv -= 32;
-        total += bytes_recv;
-        socket->ack_number = header_received.seq_number + bytes_recv;
-        create_header(socket, 0);
-        header.window=socket->curr_win_size+bytes_recv;
-        socket->curr_win_size+=bytes_recv;
-        memcpy(payload, temp_buffer_recv + sizeof(microtcp_header_t), bytes_recv);
-        memcpy(buffer + total - bytes_recv, payload, bytes_recv);
-        sendto(socket->sd, &header, sizeof(microtcp_header_t), 0, (struct sockaddr *)client_address, client_address_len);
-      }
-      else
-      {
-        create_header(socket, 0);
-        sendto(socket->sd, &header, sizeof(microtcp_header_t), 0, (struct sockaddr *)client_address, client_address_len);
-        counter_duplicate++;
-        if (i == number_loops - 1)
-        {
-          i -= (counter_duplicate);
-        }
-      }
-      //printf("\n");
-      //printf("header sent:\n");
-      //print_header(&header);
-      //printf("\n");
-      free(temp_buffer_recv);
-      free(payload);
-    }
+    shift++;
   }
-  free(tmp);
-  free(temp_size);
-  return total;
+  return shift;
+}
+/* The largest window the socket may come to advertise */
+static size_t max_window(microtcp_sock_t *socket)
+{
+  return socket->rcv_autotune ? MICROTCP_AUTOTUNE_MAX_RECVBUF : socket->init_win_size;
+}
+/*
+ * Takes the window of the peer from its SYN or SYN-ACK, once the options
+ * are agreed on, along with the scaling of the windows after. The window
+ * of a SYN is never scaled (RFC 7323), the first ACK tells the rest of
+ * it. Slow start may go on up to the largest window the peer can
+ * advertise (RFC 5681).
+ */
+static void set_window_scaling(microtcp_sock_t *socket, const microtcp_header_t *syn)
+{
+  uint32_t shift = syn->future_use2 < MICROTCP_MAX_WSCALE ? syn->future_use2 : MICROTCP_MAX_WSCALE;
+  int scaled = (socket->options & MICROTCP_OPT_WSCALE) != 0;
+  socket->flow_ctrl_win = syn->window;
+  socket->snd_wscale = scaled ? shift : 0;
+  socket->rcv_wscale = scaled ? window_scale(max_window(socket)) : 0;
+  size_t peer_max = (size_t)0xffff << socket->snd_wscale;
+  socket->ssthresh = socket->ssthresh > peer_max ? socket->ssthresh : peer_max;
+}
+/* The ACK ratio both ends go with, given ours and the one of the peer */
+static uint32_t agree_ack_ratio(uint32_t own, uint32_t peer)
+{
+  peer = peer == 0 ? 1 : peer;
+  return peer < own ? peer : own;
 }
 void send_syn(microtcp_sock_t *socket, struct sockaddr *address,
               socklen_t address_len)
@@ -592,23 +2383,47 @@ void send_syn(microtcp_sock_t *socket, struct sockaddr *address,
   uint16_t control = 0;
   control |= (1 << 13);
   create_header(socket, control);
-  header.window = socket->init_win_size;
+  uint32_t shift = window_scale(max_window(socket));
+  socket->header.window = advertised_window(socket->init_win_size, 0);
+  socket->header.future_use0 = socket->options;
+  socket->header.future_use1 = socket->ack_ratio;
+  socket->header.future_use2 = shift;
+  refresh_header_checksum(socket);
   socket->seq_number++;
   //printf("SYN,seq=N\n");
-  //print_header(&header);
-  ssize_t bytes_sent = sendto(socket->sd, &header, sizeof(microtcp_header_t), 0,
-                              address, address_len);
+  //print_header(&socket->header);
+  sendto(socket->sd, &socket->header, sizeof(microtcp_header_t), 0, address,
+         address_len);
+}
+/* Answers the SYN of a peer */
+static void send_syn_ack(microtcp_sock_t *socket, const microtcp_header_t *syn,
+                         struct sockaddr *address, socklen_t address_len)
+{
+  uint16_t control = 0;
+  control = syn->control | (1 << 11);
+  socket->ack_number = syn->seq_number + 1;
+  socket->options &= syn->future_use0;
+  socket->ack_ratio = agree_ack_ratio(socket->ack_ratio, syn->future_use1);
+  set_window_scaling(socket, syn);
+  create_header(socket, control);
+  uint32_t shift = window_scale(max_window(socket));
+  socket->header.window = advertised_window(socket->init_win_size, 0);
+  socket->header.future_use0 = socket->options;
+  socket->header.future_use1 = socket->ack_ratio;
+  socket->header.future_use2 = shift;
+  refresh_header_checksum(socket);
+  socket->seq_number++;
+  //printf("SYN,ACK,seq=M,ack=N+1:\n");
+  //print_header(&socket->header);
+  sendto(socket->sd, &socket->header, sizeof(microtcp_header_t), 0, address,
+         address_len);
 }
 void receive_syn_send_SynAck(microtcp_sock_t *socket, struct sockaddr *address,
                              socklen_t address_len)
 {
-  uint8_t *buffer;
-  uint32_t checksum;
-  buffer = malloc(sizeof(microtcp_header_t));
   microtcp_header_t tmp;
   ssize_t bytes_received =
-      recvfrom(socket->sd, buffer, 1024, 0, address, &address_len);
-  flow_ctrl_win = *((uint16_t *)(buffer + 10));
+      recvfrom(socket->sd, &tmp, sizeof(microtcp_header_t), 0, address, &address_len);
 
   //printf("\n3-Way handshake\n\n");
   if (bytes_received < 0)
@@ -617,7 +2432,6 @@ void receive_syn_send_SynAck(microtcp_sock_t *socket, struct sockaddr *address,
     return;
   }
   //printf("Received packet:\n");
-  memcpy(&tmp, buffer, sizeof(microtcp_header_t));
   //print_header(&tmp);
   if (correct_checksum(tmp) == 0)
   {
@@ -625,42 +2439,27 @@ void receive_syn_send_SynAck(microtcp_sock_t *socket, struct sockaddr *address,
   }
   if (tmp.control & (1 << 13))
   {
-    uint16_t control = 0;
-    control = tmp.control | (1 << 11);
-    socket->ack_number = tmp.seq_number + 1;
-    create_header(socket, control);
-    header.window = socket->init_win_size;
-    socket->seq_number++;
-    //printf("SYN,ACK,seq=M,ack=N+1:\n");
-    //print_header(&header);
-    sendto(socket->sd, &header, sizeof(microtcp_header_t), 0, address,
-           address_len);
+    send_syn_ack(socket, &tmp, address, address_len);
   }
   else
   {
     perror("Received packet is not SYN");
     return;
   }
-  free(buffer);
 }
 void receive_syn_ack_send_ack(microtcp_sock_t *socket, struct sockaddr *address,
                               socklen_t address_len)
 {
-  uint8_t *buffer;
-  buffer = malloc(sizeof(microtcp_header_t));
   microtcp_header_t tmp;
-  uint32_t checksum;
 
   ssize_t bytes_received = recvfrom(
-      socket->sd, buffer, sizeof(microtcp_header_t), 0, address, &address_len);
+      socket->sd, &tmp, sizeof(microtcp_header_t), 0, address, &address_len);
 
   if (bytes_received < 0)
   {
     perror("Error receiving SYN packet");
     return;
   }
-  flow_ctrl_win = *((uint16_t *)(buffer + 10));
-  memcpy(&tmp, buffer, sizeof(microtcp_header_t));
   //printf("Packet Received:\n");
   //print_header(&tmp);
   if (correct_checksum(tmp) == 0)
@@ -669,9 +2468,12 @@ void receive_syn_ack_send_ack(microtcp_sock_t *socket, struct sockaddr *address,
   }
   // Check if the received packet has both SYN and ACK flags set
   if ((tmp.control & (1 << 13)) && (tmp.control & (1 << 11)) &&
-      (tmp.ack_number == socket->seq_number))
+      (tmp.ack_number == (uint32_t)socket->seq_number))
   {
     socket->ack_number = tmp.seq_number + 1;
+    socket->options &= tmp.future_use0;
+    socket->ack_ratio = agree_ack_ratio(socket->ack_ratio, tmp.future_use1);
+    set_window_scaling(socket, &tmp);
     //printf("ACK,seq=N+1,ack=M+1\n");
     send_ack(socket, address, address_len);
     socket->seq_number++;
@@ -683,32 +2485,368 @@ void receive_syn_ack_send_ack(microtcp_sock_t *socket, struct sockaddr *address,
     perror("Received packet is not SYN-ACK");
     return;
   }
-  free(buffer);
 }
 void receive_ack(microtcp_sock_t *socket, struct sockaddr *address,
                  socklen_t address_len)
 {
-  uint8_t *buffer;
-  buffer = malloc(sizeof(microtcp_header_t));
   microtcp_header_t tmp;
-  uint32_t checksum;
-  ssize_t bytes_received = recvfrom(
-      socket->sd, buffer, sizeof(microtcp_header_t), 0, address, &address_len);
+  ssize_t bytes_received = recv_datagram(
+      socket, &tmp, sizeof(microtcp_header_t), 0, address, &address_len);
 
   if (bytes_received < 0)
   {
     perror("Error receiving SYN packet");
     return;
   }
-  memcpy(&tmp, buffer, sizeof(microtcp_header_t));
   if (correct_checksum(tmp) == 0)
   {
 //    perror("Altered bits3");
   }
-  if (!((tmp.control & (1 << 11)) && (tmp.ack_number == socket->seq_number) &&
-        (tmp.seq_number == socket->ack_number)))
+  if (!((tmp.control & (1 << 11)) && (tmp.ack_number == (uint32_t)socket->seq_number) &&
+        (tmp.seq_number == (uint32_t)socket->ack_number)))
   {
     perror("Something went w1rong");
   }
-  free(buffer);
+}
+int microtcp_listen(microtcp_sock_t *socket, int backlog)
+{
+  if (socket->state != LISTEN || socket->listener != NULL || backlog <= 0 ||
+      (socket->offload & MICROTCP_OFFLOAD_GRO))
+  {
+    return -1;
+  }
+  struct microtcp_listener *listener =
+      (struct microtcp_listener *)alloc_buffer(sizeof(struct microtcp_listener));
+  memset(listener, 0, sizeof(struct microtcp_listener));
+  listener->sd = socket->sd;
+  listener->backlog = (struct microtcp_pending_syn *)alloc_buffer(backlog * sizeof(struct microtcp_pending_syn));
+  listener->backlog_size = backlog;
+  listener->rx_buf = alloc_buffer(MICROTCP_BATCH_SIZE * SLOT_SIZE);
+  socket->listener = listener;
+  return 0;
+}
+microtcp_sock_t microtcp_listener_accept(microtcp_sock_t *listener, struct sockaddr *address,
+                                         socklen_t *address_len)
+{
+  microtcp_sock_t new_socket = *listener;
+  new_socket.state = INVALID;
+  new_socket.listener = NULL;
+  new_socket.owns_sd = 0;
+  struct microtcp_listener *l = listener->listener;
+  if (l == NULL)
+  {
+    return new_socket;
+  }
+  while (l->backlog_len == 0)
+  {
+    int n = listener_receive(l, listener->nonblock ? MSG_DONTWAIT : 0);
+    if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    {
+      perror("recvmmsg");
+      return new_socket;
+    }
+    if (listener->nonblock && l->backlog_len == 0 && (n == -1 || n < MICROTCP_BATCH_SIZE))
+    {
+      errno = EAGAIN;
+      return new_socket;
+    }
+  }
+  struct microtcp_pending_syn syn = l->backlog[l->backlog_head];
+  l->backlog_head = (l->backlog_head + 1) % l->backlog_size;
+  l->backlog_len--;
+
+  /* The datagrams of the peer go to the connection from now on */
+  microtcp_sock_t *socket = &new_socket;
+  socket->cc->init(socket);
+  socket->conn = conn_create(l, (struct sockaddr *)&syn.address, syn.address_len);
+  send_syn_ack(socket, &syn.header, (struct sockaddr *)&syn.address, syn.address_len);
+  receive_ack(socket, (struct sockaddr *)&syn.address, syn.address_len);
+  establish_accepted(socket, (struct sockaddr *)&syn.address, syn.address_len);
+  if (address != NULL)
+  {
+    *address_len = *address_len < syn.address_len ? *address_len : syn.address_len;
+    memcpy(address, &syn.address, *address_len);
+  }
+  return new_socket;
+}
+/*
+ * A socket in an event loop
+ */
+struct microtcp_loop_entry
+{
+  microtcp_sock_t *socket;
+  uint32_t events;
+  void *data;
+  int stalled;                  /* Whether datagrams may wait that no edge of epoll announces */
+};
+
+struct microtcp_loop
+{
+  int epfd;
+  struct microtcp_loop_entry *entries;
+  uint32_t len;
+  uint32_t size;
+  uint32_t next;                /* Entry the next report starts from, so that all get their turn */
+  uint8_t *ready_fds;           /* Whether epoll found each descriptor readable */
+  int ready_fds_size;
+  microtcp_timer_wheel_t wheel; /* Timers of all the sockets in the loop */
+};
+
+microtcp_loop_t *microtcp_loop_create(void)
+{
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd == -1)
+  {
+    perror("epoll_create1");
+    return NULL;
+  }
+  microtcp_loop_t *loop = (microtcp_loop_t *)alloc_buffer(sizeof(microtcp_loop_t));
+  memset(loop, 0, sizeof(microtcp_loop_t));
+  loop->epfd = epfd;
+  microtcp_wheel_init(&loop->wheel, now_us());
+  return loop;
+}
+/* Moves the socket, armed timers included, to a wheel, NULL for the one of the thread */
+static void set_wheel(microtcp_sock_t *socket, microtcp_timer_wheel_t *wheel)
+{
+  microtcp_timer_t *timers[] = {&socket->rto_timer, &socket->pace_timer, &socket->ack_timer,
+                                &socket->delack_timer, &socket->persist_timer, &socket->close_timer};
+  socket->wheel = wheel;
+  for (size_t i = 0; i < sizeof(timers) / sizeof(timers[0]); i++)
+  {
+    if (microtcp_timer_armed(timers[i]))
+    {
+      microtcp_timer_arm(socket_wheel(socket), timers[i], timers[i]->expires_us);
+    }
+  }
+}
+static void *grow_buffer(void *buffer, size_t size)
+{
+  buffer = realloc(buffer, size);
+  if (buffer == NULL)
+  {
+    perror("Memory allocation failed");
+    exit(EXIT_FAILURE);
+  }
+  return buffer;
+}
+int microtcp_loop_add(microtcp_loop_t *loop, microtcp_sock_t *socket, uint32_t events,
+                      void *data)
+{
+  if (!socket->nonblock)
+  {
+    return -1;
+  }
+  for (uint32_t i = 0; i < loop->len; i++)
+  {
+    if (loop->entries[i].socket == socket)
+    {
+      return -1;
+    }
+  }
+  /* Edge-triggered, the sockets are drained on every edge */
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.fd = socket->sd;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, socket->sd, &ev) == -1 && errno != EEXIST)
+  {
+    perror("epoll_ctl");
+    return -1;
+  }
+  if (loop->len == loop->size)
+  {
+    loop->size = loop->size == 0 ? 16 : loop->size * 2;
+    loop->entries = (struct microtcp_loop_entry *)grow_buffer(loop->entries, loop->size * sizeof(struct microtcp_loop_entry));
+  }
+  if (socket->sd >= loop->ready_fds_size)
+  {
+    loop->ready_fds = (uint8_t *)grow_buffer(loop->ready_fds, socket->sd + 1);
+    memset(loop->ready_fds + loop->ready_fds_size, 0, socket->sd + 1 - loop->ready_fds_size);
+    loop->ready_fds_size = socket->sd + 1;
+  }
+  struct microtcp_loop_entry *entry = &loop->entries[loop->len++];
+  entry->socket = socket;
+  entry->events = events;
+  entry->data = data;
+  /* Whatever arrived before is picked up by the next wait */
+  entry->stalled = 1;
+  set_wheel(socket, &loop->wheel);
+  return 0;
+}
+int microtcp_loop_del(microtcp_loop_t *loop, microtcp_sock_t *socket)
+{
+  uint32_t i = 0;
+  while (i < loop->len && loop->entries[i].socket != socket)
+  {
+    i++;
+  }
+  if (i == loop->len)
+  {
+    return -1;
+  }
+  loop->entries[i] = loop->entries[--loop->len];
+  set_wheel(socket, NULL);
+  for (i = 0; i < loop->len; i++)
+  {
+    if (loop->entries[i].socket->sd == socket->sd)
+    {
+      /* The connections of a listener share its descriptor */
+      return 0;
+    }
+  }
+  epoll_ctl(loop->epfd, EPOLL_CTL_DEL, socket->sd, NULL);
+  return 0;
+}
+/* Takes the transfer of the socket as far as it goes without blocking */
+static int drive(microtcp_sock_t *socket)
+{
+  if (socket->listener != NULL)
+  {
+    while (listener_receive(socket->listener, MSG_DONTWAIT) > 0)
+    {
+    }
+    return 0;
+  }
+  if (socket->state != ESTABLISHED)
+  {
+    return 0;
+  }
+  if (socket->snd_data != NULL)
+  {
+    return send_step(socket);
+  }
+  return recv_step(socket);
+}
+static uint32_t readiness(microtcp_sock_t *socket)
+{
+  if (socket->listener != NULL)
+  {
+    return socket->listener->backlog_len > 0 ? MICROTCP_EV_READABLE : 0;
+  }
+  if (socket->state != ESTABLISHED)
+  {
+    return MICROTCP_EV_CLOSED;
+  }
+  uint32_t events = 0;
+  if (socket->buf_fill_level > 0 || socket->rcv_fin)
+  {
+    events |= MICROTCP_EV_READABLE;
+  }
+  if (socket->snd_data == NULL || snd_held(socket) < MICROTCP_SNDBUF_LEN)
+  {
+    events |= MICROTCP_EV_WRITABLE;
+  }
+  return events;
+}
+/* Whether the socket has work to do that no edge of epoll will announce */
+static int needs_drive(microtcp_loop_t *loop, struct microtcp_loop_entry *entry)
+{
+  microtcp_sock_t *socket = entry->socket;
+  if (loop->ready_fds[socket->sd])
+  {
+    return 1;
+  }
+  if (socket->state != ESTABLISHED)
+  {
+    return 0;
+  }
+  if (socket->snd_data != NULL)
+  {
+    /* Its timers go off by themselves */
+    return socket->conn != NULL && socket->conn->len > 0;
+  }
+  /* It was just added, or a listener queued datagrams */
+  return entry->stalled || (socket->conn != NULL && socket->conn->len > 0);
+}
+static void loop_drive(microtcp_loop_t *loop)
+{
+  int again;
+  do
+  {
+    microtcp_wheel_advance(&loop->wheel, now_us());
+    again = 0;
+    for (uint32_t i = 0; i < loop->len; i++)
+    {
+      struct microtcp_loop_entry *entry = &loop->entries[i];
+      if (needs_drive(loop, entry))
+      {
+        drive(entry->socket);
+        entry->stalled = 0;
+      }
+    }
+    memset(loop->ready_fds, 0, loop->ready_fds_size);
+    /* Driving a connection of a listener may queue datagrams for another */
+    for (uint32_t i = 0; i < loop->len && !again; i++)
+    {
+      microtcp_sock_t *socket = loop->entries[i].socket;
+      again = socket->conn != NULL && socket->conn->len > 0 && socket->state == ESTABLISHED;
+    }
+  } while (again);
+}
+static int loop_report(microtcp_loop_t *loop, microtcp_event_t *events, int max_events)
+{
+  int n = 0;
+  for (uint32_t i = 0; i < loop->len && n < max_events; i++)
+  {
+    struct microtcp_loop_entry *entry = &loop->entries[(loop->next + i) % loop->len];
+    uint32_t ready = readiness(entry->socket) & (entry->events | MICROTCP_EV_CLOSED);
+    if (ready != 0)
+    {
+      events[n].socket = entry->socket;
+      events[n].events = ready;
+      events[n].data = entry->data;
+      n++;
+    }
+  }
+  if (loop->len > 0)
+  {
+    loop->next = (loop->next + 1) % loop->len;
+  }
+  return n;
+}
+int microtcp_loop_wait(microtcp_loop_t *loop, microtcp_event_t *events, int max_events,
+                       int timeout_ms)
+{
+  uint64_t deadline = timeout_ms < 0 ? 0 : now_us() + (uint64_t)timeout_ms * 1000;
+  for (;;)
+  {
+    loop_drive(loop);
+    int n = loop_report(loop, events, max_events);
+    uint64_t now = now_us();
+    if (n > 0 || (deadline != 0 && deadline <= now))
+    {
+      return n;
+    }
+    /* Sleep until a datagram, a timer of a socket or the timeout */
+    uint64_t wakeup = deadline;
+    uint64_t timer = microtcp_wheel_next(&loop->wheel);
+    if (timer != 0 && (wakeup == 0 || timer < wakeup))
+    {
+      wakeup = timer;
+    }
+    int wait_ms = wakeup == 0 ? -1 : wakeup <= now ? 0 : (int)((wakeup - now + 999) / 1000);
+    struct epoll_event ready[MICROTCP_BATCH_SIZE];
+    int m = epoll_wait(loop->epfd, ready, MICROTCP_BATCH_SIZE, wait_ms);
+    if (m == -1 && errno != EINTR)
+    {
+      perror("epoll_wait");
+      return -1;
+    }
+    for (int i = 0; i < m; i++)
+    {
+      loop->ready_fds[ready[i].data.fd] = 1;
+    }
+  }
+}
+void microtcp_loop_destroy(microtcp_loop_t *loop)
+{
+  for (uint32_t i = 0; i < loop->len; i++)
+  {
+    set_wheel(loop->entries[i].socket, NULL);
+  }
+  close(loop->epfd);
+  free(loop->entries);
+  free(loop->ready_fds);
+  free(loop);
 }
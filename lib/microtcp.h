@@ -29,11 +29,82 @@
  * Several useful constants
  */
 #define MICROTCP_ACK_TIMEOUT_US 200000
+#define MICROTCP_ACK_RATIO 2 /**< Full segments one delayed ACK may cover, by default */
+#define MICROTCP_MAX_ACK_RATIO 16 /**< Highest ratio microtcp_set_ack_ratio() takes */
+#define MICROTCP_DELACK_US 500 /**< Longest an ACK is held back for the segments after */
+#define MICROTCP_MIN_RTO_US 1000
+#define MICROTCP_MAX_RTO_US 60000000
+#define MICROTCP_PAWS_IDLE_US 600000000
+#define MICROTCP_FIN_RETRIES 5 /**< Times microtcp_shutdown() sends the FIN again before it gives up on the peer */
+#define MICROTCP_PACING_BURST_US 1000 /**< Sending time a paced sender may catch up on at once */
 #define MICROTCP_MSS 1400
-#define MICROTCP_RECVBUF_LEN 8192
+#define MICROTCP_RECVBUF_LEN 8192 /**< Receive buffer of a socket, unless microtcp_set_rcvbuf() says otherwise */
+#define MICROTCP_MAX_WSCALE 14 /**< Largest window scale shift, as in RFC 7323 */
+#define MICROTCP_MAX_RECVBUF_LEN ((size_t)0xffff << MICROTCP_MAX_WSCALE) /**< Largest window a scaled header carries */
+#define MICROTCP_AUTOTUNE_MAX_RECVBUF (16 * 1024 * 1024) /**< Largest receive buffer autotuning grows to */
+#define MICROTCP_RECVBUF_MEM_LIMIT (256 * 1024 * 1024) /**< Default of microtcp_set_rcvbuf_limit() */
+#define MICROTCP_SNDBUF_LEN (4 * 1024 * 1024) /**< Unacknowledged data a non-blocking socket holds for the peer */
 #define MICROTCP_WIN_SIZE MICROTCP_RECVBUF_LEN
 #define MICROTCP_INIT_CWND (3 * MICROTCP_MSS)
 #define MICROTCP_INIT_SSTHRESH MICROTCP_WIN_SIZE
+#define MICROTCP_DUP_ACK_THRESHOLD 3
+#define MICROTCP_MAX_SACK_BLOCKS 3
+#define MICROTCP_MAX_OOO_RANGES 32
+#define MICROTCP_BATCH_SIZE 32 /**< Datagrams per sendmmsg() and recvmmsg() */
+#define MICROTCP_CC_PRIV_SIZE 32 /**< 64-bit words of private congestion control state */
+#define MICROTCP_LISTEN_BUCKETS 256 /**< Hash buckets of the connections of a listener, a power of two */
+#define MICROTCP_CONN_QUEUE 64 /**< Datagrams a listener holds for a connection until it reads them */
+#define MICROTCP_TIMER_TICK_US 100 /**< Resolution of the timer wheel */
+#define MICROTCP_WHEEL_SLOTS 64 /**< Slots per level of the timer wheel, a power of two */
+#define MICROTCP_WHEEL_LEVELS 4 /**< Levels of the timer wheel, each MICROTCP_WHEEL_SLOTS times coarser
+                                     than the one below */
+
+/*
+ * Options negotiated at the 3-way handshake. The SYN carries the options
+ * the client supports in future_use0 and the SYN-ACK the subset the server
+ * agreed on.
+ */
+#define MICROTCP_OPT_SACK (1 << 0) /**< Selective acknowledgements */
+#define MICROTCP_OPT_TIMESTAMPS (1 << 1) /**< Timestamp echo, for RTT measurement and PAWS */
+#define MICROTCP_OPT_WSCALE (1 << 2) /**< Window scaling, see below */
+
+/*
+ * The SYN and the SYN-ACK carry in future_use2 the shift their window
+ * field is scaled by. With MICROTCP_OPT_WSCALE in effect the window of
+ * every later segment is scaled by the shift its sender announced,
+ * otherwise it is in bytes and at most 0xffff.
+ */
+
+/*
+ * The SYN and the SYN-ACK also carry in future_use1 the ACK ratio of their
+ * sender, see microtcp_set_ack_ratio(). Both ends go with the lower of the
+ * two, a peer that sends 0 knows no delayed ACKs and gets a ratio of 1.
+ * A data segment the sender waits on before it sends more has the control
+ * bit MICROTCP_ACK_NOW set, and the receiver ACKs it at once.
+ */
+#define MICROTCP_ACK_NOW (1 << 10)
+
+/*
+ * Flag of the type of microtcp_socket(). Sending and receiving on the
+ * socket return -1 with errno EAGAIN instead of blocking, see
+ * microtcp_loop_wait() for when to retry.
+ */
+#define MICROTCP_NONBLOCK SOCK_NONBLOCK
+
+/*
+ * Readiness of a socket, reported by microtcp_loop_wait()
+ */
+#define MICROTCP_EV_READABLE (1 << 0) /**< Data or the end of it waits for microtcp_recv(), or a peer for
+                                           microtcp_listener_accept() */
+#define MICROTCP_EV_WRITABLE (1 << 1) /**< microtcp_send() has room for more data */
+#define MICROTCP_EV_CLOSED (1 << 2) /**< The connection is closed, always reported */
+
+/*
+ * Offloads to the kernel, see microtcp_set_offload(). They are local to
+ * each peer, the datagrams on the wire stay the same.
+ */
+#define MICROTCP_OFFLOAD_GSO (1 << 0) /**< The kernel cuts a batch of full segments into datagrams, UDP_SEGMENT */
+#define MICROTCP_OFFLOAD_GRO (1 << 1) /**< The kernel coalesces received segments, UDP_GRO */
 
 /**
  * Possible states of the microTCP socket
@@ -52,6 +123,98 @@ typedef enum
 } mircotcp_state_t;
 
 
+/**
+ * Flags of an in flight segment
+ */
+#define MICROTCP_SEG_LOST (1 << 0) /**< Considered lost, waits for retransmission */
+#define MICROTCP_SEG_SACKED (1 << 1) /**< Selectively acknowledged, never retransmitted */
+
+/**
+ * A range [start, end) of sequence numbers
+ */
+typedef struct
+{
+  uint32_t start;
+  uint32_t end;
+} microtcp_sack_block_t;
+
+/**
+ * A data segment that has been transmitted but not yet cumulatively
+ * acknowledged by the peer. The payload is not copied; it points into the
+ * buffer handed to microtcp_send(), which does not return before every
+ * byte of it is acknowledged.
+ */
+typedef struct
+{
+  uint32_t seq_number;          /**< Sequence number of the first payload byte */
+  uint32_t data_len;            /**< Payload length in bytes */
+  const uint8_t *data;          /**< The payload of the segment */
+  uint64_t sent_us;             /**< Time of the last (re)transmission, in microseconds */
+  uint16_t retransmits;         /**< How many times the segment has been retransmitted */
+  uint16_t flags;               /**< MICROTCP_SEG_* flags */
+} microtcp_segment_t;
+
+/**
+ * A timer on a hierarchical timer wheel. It is linked into the wheel while
+ * armed, so it must not move until it fires or is cancelled.
+ */
+typedef struct microtcp_timer
+{
+  struct microtcp_timer *next;  /**< Next timer in the same slot */
+  struct microtcp_timer **pprev; /**< The link that points to this timer, NULL when not armed */
+  struct microtcp_timer_wheel *wheel; /**< Wheel the timer is armed on */
+  uint32_t level;               /**< Level of the wheel the timer is on */
+  uint64_t expires_us;          /**< When the timer fires */
+  void (*fire)(struct microtcp_timer *timer); /**< Called once the timer expires, disarmed */
+} microtcp_timer_t;
+
+/**
+ * Timers sorted into slots by expiration, in O(1) for arming, cancelling
+ * and each tick whatever their number. Level 0 has a slot per tick, every
+ * slot of level n covers a whole turn of level n - 1, and its timers are
+ * spread over level n - 1 when that turn comes.
+ */
+typedef struct microtcp_timer_wheel
+{
+  uint64_t tick;                /**< Last tick processed, in units of MICROTCP_TIMER_TICK_US */
+  uint32_t armed;               /**< Number of armed timers */
+  uint32_t level_len[MICROTCP_WHEEL_LEVELS]; /**< Number of armed timers on each level */
+  microtcp_timer_t *slots[MICROTCP_WHEEL_LEVELS][MICROTCP_WHEEL_SLOTS];
+} microtcp_timer_wheel_t;
+
+/**
+ * microTCP header structure
+ * NOTE: DO NOT CHANGE!
+ *
+ * When MICROTCP_OPT_TIMESTAMPS is in effect, every data segment and ACK
+ * carries the sender's clock in microseconds (TSval) in future_use0 and
+ * echoes the latest timestamp received in order from the peer (TSecr) in
+ * future_use1.
+ *
+ * When MICROTCP_OPT_SACK is in effect, each of the future_use words of an
+ * ACK left free by the timestamps may carry a SACK block: the upper 16
+ * bits hold the offset of the block from ack_number and the lower 16 bits
+ * its length, both in units of 2^shift bytes, shift being the window
+ * scale the receiver announced (0 without MICROTCP_OPT_WSCALE). The
+ * receiver rounds each block inwards to whole units, so that it never
+ * claims a byte it does not hold, and a range shorter than a unit goes
+ * unreported. The scale is the smallest that fits the largest window of
+ * the receiver, with the autotuned receive buffer a unit is 512 bytes.
+ * A zero word carries no block.
+ */
+typedef struct
+{
+  uint32_t seq_number;          /**< Sequence number */
+  uint32_t ack_number;          /**< ACK number */
+  uint16_t control;             /**< Control bits (e.g. SYN, ACK, FIN) */
+  uint16_t window;              /**< Window size in bytes */
+  uint32_t data_len;            /**< Data length in bytes (EXCLUDING header) */
+  uint32_t future_use0;         /**< 32-bits for future use */
+  uint32_t future_use1;         /**< 32-bits for future use */
+  uint32_t future_use2;         /**< 32-bits for future use */
+  uint32_t checksum;            /**< CRC-32 checksum, see crc32() in utils folder */
+} microtcp_header_t;
+
 /**
  * This is the microTCP socket structure. It holds all the necessary
  * information of each microTCP socket.
@@ -61,21 +224,102 @@ typedef enum
 typedef struct
 {
   int sd;                       /**< The underline UDP socket descriptor */
+  int owns_sd;                  /**< Whether microtcp_close() closes sd, not for the connections of a
+                                     listener, which send through its descriptor */
   mircotcp_state_t state;       /**< The state of the microTCP socket */
+  int nonblock;                 /**< Whether the socket is non-blocking, see MICROTCP_NONBLOCK */
+  int is_client;                /**< Whether the connection was opened by microtcp_connect() */
+  struct sockaddr_storage peer_address; /**< Address of the remote end of the connection */
+  socklen_t peer_address_len;   /**< Length of peer_address */
+  microtcp_header_t header;     /**< Header of the next segment to send */
   size_t init_win_size;         /**< The window size negotiated at the 3-way handshake */
   size_t curr_win_size;         /**< The current window size */
 
   uint8_t *recvbuf;             /**< The *receive* buffer of the TCP
                                      connection. It is allocated during the connection establishment and
                                      is freed at the shutdown of the connection. This buffer is used
-                                     to retrieve the data from the network. */
-  size_t buf_fill_level;        /**< Amount of data in the buffer */
+                                     to retrieve the data from the network. It is a ring that holds the
+                                     data received in order until microtcp_recv() reads it, from
+                                     rcv_head on, and past it the segments that arrived out of order,
+                                     at their distance from the first byte not read yet. */
+  size_t recvbuf_len;           /**< Length of recvbuf, see microtcp_set_rcvbuf() */
+  int rcv_autotune;             /**< Whether recvbuf grows with the bandwidth-delay product, until
+                                     microtcp_set_rcvbuf() fixes its size */
+  uint64_t rcv_rtt_us;          /**< Round trip time seen by the receiver, from its echoed timestamps */
+  uint64_t rcv_space_start_us;  /**< Start of the current delivery rate measurement, 0 before any */
+  size_t rcv_space_bytes;       /**< Bytes delivered in order since rcv_space_start_us */
+  size_t buf_fill_level;        /**< Amount of data in the buffer, received in order and not read yet */
+  size_t rcv_head;              /**< Position in recvbuf of the first byte not read yet */
+  int rcv_fin;                  /**< Whether the FIN of the peer came before all the data was read */
 
+  size_t flow_ctrl_win;         /**< The window last advertised by the peer, in bytes from snd_una */
+  uint32_t snd_wscale;          /**< Shift of the windows the peer advertises */
+  uint32_t rcv_wscale;          /**< Shift of the windows we advertise */
+  size_t rcv_wnd_adv;           /**< The window our last ACK advertised */
   size_t cwnd;
   size_t ssthresh;
+  const struct microtcp_cc_ops *cc; /**< Congestion control module, owns cwnd and ssthresh */
+  uint64_t cc_priv[MICROTCP_CC_PRIV_SIZE]; /**< Private state of the congestion control module */
 
   size_t seq_number;            /**< Keep the state of the sequence number */
   size_t ack_number;            /**< Keep the state of the ack number */
+  size_t snd_una;               /**< Oldest sequence number not yet acknowledged by the peer */
+  size_t pipe;                  /**< Bytes in flight, i.e. sent and neither acknowledged nor lost */
+  uint32_t dup_acks;            /**< Consecutive duplicate ACKs received for snd_una */
+  size_t recover;               /**< seq_number when fast recovery was last entered or the timer expired */
+  uint64_t recovery_start_us;   /**< When fast recovery was entered, 0 outside of it */
+  int pacing;                   /**< Whether segments are paced, see microtcp_set_pacing() */
+  uint64_t max_pacing_rate;     /**< Cap of the pacing rate in bytes per second, 0 for none */
+  uint64_t next_send_us;        /**< Earliest time the next paced segment may leave */
+  uint64_t srtt_us;             /**< Smoothed round trip time, 0 before the first sample */
+  uint64_t rttvar_us;           /**< Round trip time variation */
+  uint64_t rto_us;              /**< Current retransmission timeout, backed off on expiration */
+  uint64_t rto_min_us;          /**< Lower bound of rto_us */
+  uint64_t rto_max_us;          /**< Upper bound of rto_us */
+  uint32_t ts_recent;           /**< Latest in order timestamp of the peer, echoed back */
+  uint64_t ts_recent_us;        /**< When ts_recent was updated, 0 if never */
+  uint32_t options;             /**< MICROTCP_OPT_* options, in effect after the handshake */
+  uint32_t ack_ratio;           /**< Full segments per ACK, see microtcp_set_ack_ratio() */
+  uint32_t ack_pending;         /**< Full segments received in order since our last ACK */
+  microtcp_sack_block_t rcv_sack[MICROTCP_MAX_SACK_BLOCKS]; /**< Out of order data held by the receiver, the range above the hole first */
+  uint32_t rcv_sack_len;        /**< Number of valid entries in rcv_sack */
+  microtcp_sack_block_t ooo[MICROTCP_MAX_OOO_RANGES]; /**< Out of order data held in recvbuf, sorted */
+  uint32_t ooo_len;             /**< Number of valid entries in ooo */
+
+  microtcp_segment_t *retrans_queue; /**< Ring of the in flight segments, oldest first */
+  size_t rq_head;               /**< Index of the oldest segment in retrans_queue */
+  size_t rq_len;                /**< Number of segments in retrans_queue */
+  size_t rq_size;               /**< Capacity of retrans_queue */
+
+  struct microtcp_tx_datagram *tx_batch; /**< Datagrams waiting for the next sendmmsg(), up to
+                                     MICROTCP_BATCH_SIZE */
+  uint32_t tx_len;              /**< Number of datagrams in tx_batch */
+  uint8_t *rx_buf;              /**< Datagrams of the last receive, in slots of a header and an
+                                     MSS each or as coalesced by GRO */
+  uint32_t offload;             /**< MICROTCP_OFFLOAD_* in effect */
+
+  const uint8_t *snd_data;      /**< Data being sent, NULL if none */
+  size_t snd_length;            /**< Length of snd_data */
+  size_t snd_first;             /**< Sequence number of the first byte of snd_data */
+  uint8_t *snd_copy;            /**< Send buffer of a non-blocking socket, snd_data while it sends */
+  size_t snd_copy_size;         /**< Capacity of snd_copy */
+
+  microtcp_timer_wheel_t *wheel; /**< Wheel of the event loop the socket is in, NULL for the one of
+                                     the calling thread */
+  microtcp_timer_t rto_timer;   /**< Retransmission timer */
+  microtcp_timer_t pace_timer;  /**< Sends the next paced segment, outside of a blocking send */
+  microtcp_timer_t ack_timer;   /**< Repeats the last ACK while the peer goes silent with data missing */
+  microtcp_timer_t delack_timer; /**< Sends an ACK held back for the segments after */
+  microtcp_timer_t persist_timer; /**< Probes a zero window of the peer */
+  uint32_t persist_backoff;     /**< Probes sent into the current zero window */
+  microtcp_timer_t close_timer; /**< Repeats our FIN until the peer answers it */
+  uint32_t close_retries;       /**< Times the FIN was repeated */
+
+  struct microtcp_listener *listener; /**< Connections and backlog of a listening socket, see
+                                     microtcp_listen(), NULL for any other */
+  struct microtcp_conn *conn;   /**< Entry of a connection in the listener that accepted it,
+                                     which receives its datagrams, NULL for any other */
+
   uint64_t packets_send;
   uint64_t packets_received;
   uint64_t packets_lost;
@@ -85,23 +329,70 @@ typedef struct
 } microtcp_sock_t;
 
 /**
- * microTCP header structure
- * NOTE: DO NOT CHANGE!
+ * A congestion control module. The sender reports to it every ACK of new
+ * data, every loss detected by duplicate or selective ACKs and every
+ * expiration of the retransmission timer, and the module adjusts cwnd and
+ * ssthresh in response. Modules keep any other state in cc_priv.
  */
-typedef struct
+typedef struct microtcp_cc_ops
 {
-  uint32_t seq_number;          /**< Sequence number */
-  uint32_t ack_number;          /**< ACK number */
-  uint16_t control;             /**< Control bits (e.g. SYN, ACK, FIN) */
-  uint16_t window;              /**< Window size in bytes */
-  uint32_t data_len;            /**< Data length in bytes (EXCLUDING header) */
-  uint32_t future_use0;         /**< 32-bits for future use */
-  uint32_t future_use1;         /**< 32-bits for future use */
-  uint32_t future_use2;         /**< 32-bits for future use */
-  uint32_t checksum;            /**< CRC-32 checksum, see crc32() in utils folder */
-} microtcp_header_t;
+  const char *name;
+  void (*init)(microtcp_sock_t *socket);
+  /** acked bytes were newly acknowledged, rtt_us is the round trip time
+      they measured or 0 if none */
+  void (*on_ack)(microtcp_sock_t *socket, size_t acked, uint64_t rtt_us);
+  void (*on_loss)(microtcp_sock_t *socket);
+  void (*on_timeout)(microtcp_sock_t *socket);
+  /** Bytes per second the sender should pace at, 0 to leave it to cwnd */
+  uint64_t (*pacing_rate)(microtcp_sock_t *socket);
+} microtcp_cc_ops_t;
+
+extern const microtcp_cc_ops_t microtcp_cc_newreno;
+extern const microtcp_cc_ops_t microtcp_cc_cubic;
+extern const microtcp_cc_ops_t microtcp_cc_bbr;
+
+/**
+ * Starts an empty timer wheel at time now_us.
+ */
+extern void microtcp_wheel_init(microtcp_timer_wheel_t *wheel, uint64_t now_us);
+
+/**
+ * Runs the timers of the wheel due by now_us, in order of expiration.
+ * Their callbacks may arm timers again.
+ *
+ * @return the number of timers that fired
+ */
+extern int microtcp_wheel_advance(microtcp_timer_wheel_t *wheel, uint64_t now_us);
+
+/**
+ * @return a time by which microtcp_wheel_advance() has to be called again,
+ * at the latest when the next timer is due, or 0 if no timer is armed
+ */
+extern uint64_t microtcp_wheel_next(const microtcp_timer_wheel_t *wheel);
+
+/**
+ * Sets up a timer that is not armed, with its callback.
+ */
+extern void microtcp_timer_init(microtcp_timer_t *timer, void (*fire)(microtcp_timer_t *timer));
+
+/**
+ * Arms the timer on the wheel to fire at expires_us, whether or not it was
+ * armed before, here or on another wheel. It fires no sooner, and at
+ * most one tick of MICROTCP_TIMER_TICK_US later.
+ */
+extern void microtcp_timer_arm(microtcp_timer_wheel_t *wheel, microtcp_timer_t *timer,
+                               uint64_t expires_us);
+
+/**
+ * Disarms the timer, if it is armed.
+ */
+extern void microtcp_timer_cancel(microtcp_timer_t *timer);
+
+/**
+ * @return whether the timer is armed
+ */
+extern int microtcp_timer_armed(const microtcp_timer_t *timer);
 
-extern microtcp_header_t header;
 
 
 extern void send_ack(microtcp_sock_t *socket, struct sockaddr *address,
@@ -146,15 +437,250 @@ int
 microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,
                  socklen_t address_len);
 
+/**
+ * Lets the socket share its port with other sockets of the process that
+ * set the option too, with SO_REUSEPORT. The kernel then spreads the peers
+ * over them by the hash of their 4-tuple, so a server can have a listener
+ * per worker thread, each with connections of its own and no locking
+ * between them. As the spread changes with the number of sockets, all of
+ * them should be bound before the first peer connects.
+ *
+ * @param socket the socket structure, not bound yet
+ * @param enable 1 to share the port, 0 not to
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_set_reuseport(microtcp_sock_t *socket, int enable);
+
+/**
+ * Turns a bound socket into a listener, which serves many peers on its
+ * UDP port. The datagrams that arrive on it are demultiplexed by the
+ * address of their sender to the connections accepted so far, and the
+ * SYNs of new peers wait in a backlog for microtcp_listener_accept().
+ *
+ * A listener and its connections share the UDP socket, so they must be
+ * driven from a single thread. Receiving on any of them queues the
+ * datagrams of the others, up to MICROTCP_CONN_QUEUE each.
+ *
+ * @param socket the socket structure, bound with microtcp_bind()
+ * @param backlog how many SYNs may wait to be accepted
+ * @return 0 on success or -1 if the socket is not bound or uses GRO
+ */
+int
+microtcp_listen(microtcp_sock_t *socket, int backlog);
+
+/**
+ * Blocks waiting for a new connection on a listener and completes the
+ * 3-way handshake with it. The new socket inherits the settings of the
+ * listener, such as its congestion control and pacing. A non-blocking
+ * listener fails with EAGAIN when no peer waits, the handshake itself
+ * still takes a round trip.
+ *
+ * @param listener the socket structure of the listener
+ * @param address pointer to store the address information of the connected peer,
+ * or NULL
+ * @param address_len the length of the address structure, set to the length
+ * of the address stored
+ * @return the socket structure of the connection, in state ESTABLISHED, or
+ * INVALID on failure
+ */
+microtcp_sock_t
+microtcp_listener_accept(microtcp_sock_t *listener, struct sockaddr *address,
+                         socklen_t *address_len);
+
+/**
+ * Shuts a connection down. On a listener it releases the backlog instead,
+ * once all the connections it accepted are shut down.
+ */
 int
 microtcp_shutdown(microtcp_sock_t *socket, int how);
 
+/**
+ * Closes the UDP socket under a microTCP socket, once it is shut down. A
+ * connection returned by microtcp_listener_accept() shares the descriptor
+ * of its listener, which stays open, so that the other connections carry
+ * on. Never close() the descriptor of such a connection directly.
+ *
+ * @param socket the socket structure
+ * @return 0 on success or -1 on failure, or if it is a listener that has
+ *         not been shut down
+ */
+int
+microtcp_close(microtcp_sock_t *socket);
+
+/**
+ * Sets the bounds of the adaptive retransmission timeout. The timeout is
+ * derived from the measured round trip time and doubles on every
+ * expiration, but always stays within these bounds.
+ *
+ * @param socket the socket structure
+ * @param min_us the lowest timeout in microseconds
+ * @param max_us the highest timeout in microseconds
+ * @return 0 on success or -1 if the bounds are invalid
+ */
+int
+microtcp_set_rto_bounds(microtcp_sock_t *socket, uint64_t min_us, uint64_t max_us);
+
+/**
+ * Selects the congestion control module of the socket. The module starts
+ * over from the initial window.
+ *
+ * @param socket the socket structure
+ * @param name one of "newreno" (the default), "cubic" or "bbr"
+ * @return 0 on success or -1 if there is no module with this name
+ */
+int
+microtcp_set_congestion_control(microtcp_sock_t *socket, const char *name);
+
+/**
+ * Enables or disables pacing. A paced sender spreads the segments of its
+ * window over the round trip time instead of sending them back to back.
+ * The rate is the one of the congestion control module, or derived from
+ * cwnd and the smoothed round trip time if the module has none.
+ *
+ * @param socket the socket structure
+ * @param enable 1 to pace the segments, 0 to send them as the window allows
+ * @param max_rate the highest rate in bytes per second, 0 for no cap
+ * @return 0 on success or -1 if enable is neither 0 nor 1
+ */
+int
+microtcp_set_pacing(microtcp_sock_t *socket, int enable, uint64_t max_rate);
+
+/**
+ * Sets how many full segments received in order one ACK may cover. The
+ * receiver holds its ACK back until that many arrived, for at most
+ * MICROTCP_DELACK_US, but ACKs out of order segments, the ones that fill a
+ * gap, duplicates and the end of a message at once. The peers agree on the
+ * lower of their ratios at the handshake, so it has to be set before
+ * microtcp_connect() or microtcp_listen().
+ *
+ * @param socket the socket structure
+ * @param ratio segments per ACK, 1 to ACK every segment
+ * @return 0 on success or -1 if ratio is 0 or above MICROTCP_MAX_ACK_RATIO
+ */
+int
+microtcp_set_ack_ratio(microtcp_sock_t *socket, uint32_t ratio);
+
+/**
+ * Sets the size of the receive buffer, which is also the window the socket
+ * advertises. Windows beyond the 16 bits of the header are scaled, if the
+ * peer agrees at the handshake, so it has to be set before microtcp_connect()
+ * or microtcp_listen(). Otherwise the buffer starts at MICROTCP_RECVBUF_LEN
+ * and is autotuned: once per round trip it grows to twice the bandwidth-delay
+ * product the receiver measures, up to MICROTCP_AUTOTUNE_MAX_RECVBUF.
+ *
+ * @param socket the socket structure
+ * @param size the buffer size in bytes
+ * @return 0 on success or -1 if size is below MICROTCP_MSS, above
+ *         MICROTCP_MAX_RECVBUF_LEN or the connection is established
+ */
+int
+microtcp_set_rcvbuf(microtcp_sock_t *socket, size_t size);
+
+/**
+ * Caps the memory the receive buffers of all the connections of the
+ * process take together. Autotuning grows no buffer beyond it, buffers
+ * already allocated stay as they are.
+ *
+ * @param limit the cap in bytes, MICROTCP_RECVBUF_MEM_LIMIT by default
+ */
+void
+microtcp_set_rcvbuf_limit(size_t limit);
+
+/**
+ * Enables UDP segmentation and receive offloads. With GSO the segments
+ * of a batch are handed to the kernel as one buffer, and with GRO the
+ * kernel hands segments of the peer over as one buffer. If the device
+ * turns out not to support GSO the socket falls back to batches of
+ * datagrams.
+ *
+ * @param socket the socket structure
+ * @param offload the MICROTCP_OFFLOAD_* flags to enable, 0 to disable both
+ * @return 0 on success or -1 if the kernel does not support them
+ */
+int
+microtcp_set_offload(microtcp_sock_t *socket, uint32_t offload);
+
+/**
+ * Sends a message. A blocking socket returns once the peer acknowledged
+ * all of it. A non-blocking one copies as much of it as its send buffer
+ * of MICROTCP_SNDBUF_LEN has room for and returns how much that was, or
+ * fails with EAGAIN while the buffer is full.
+ */
 ssize_t
 microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length,
                int flags);
 
+/**
+ * Receives from the byte stream of the connection, whatever the peer
+ * sent with how many calls of microtcp_send(). Returns the data received
+ * in order so far, up to length bytes, and blocks only while there is
+ * none. A non-blocking socket fails with EAGAIN instead, and returns 0
+ * once the peer closed the connection and all the data has been read.
+ */
 ssize_t
 microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags);
 
+/**
+ * An event loop that waits on many non-blocking sockets at once, with a
+ * single epoll instance, and drives their transfers and timers in the
+ * background.
+ */
+typedef struct microtcp_loop microtcp_loop_t;
+
+typedef struct
+{
+  microtcp_sock_t *socket;      /**< The socket that is ready */
+  uint32_t events;              /**< Its MICROTCP_EV_* readiness */
+  void *data;                   /**< What it was added to the loop with */
+} microtcp_event_t;
+
+/**
+ * @return a new event loop, or NULL on failure
+ */
+microtcp_loop_t *
+microtcp_loop_create(void);
+
+/**
+ * Adds a socket to the loop. The loop keeps the pointer, so the socket
+ * structure must stay in place until it is removed.
+ *
+ * @param loop the event loop
+ * @param socket a non-blocking socket, connected, accepted or a listener
+ * @param events the MICROTCP_EV_* readiness to report
+ * @param data anything, handed back with the events of the socket
+ * @return 0 on success or -1 on failure
+ */
+int
+microtcp_loop_add(microtcp_loop_t *loop, microtcp_sock_t *socket, uint32_t events,
+                  void *data);
+
+/**
+ * Removes a socket from the loop.
+ *
+ * @return 0 on success or -1 if the socket is not in the loop
+ */
+int
+microtcp_loop_del(microtcp_loop_t *loop, microtcp_sock_t *socket);
+
+/**
+ * Waits until some of the sockets of the loop are ready. Readiness is
+ * level-triggered: a socket is reported for as long as it is ready.
+ * Meanwhile the loop processes the datagrams that arrive, sends what the
+ * windows allow and fires the retransmission and pacing timers.
+ *
+ * @param loop the event loop
+ * @param events where to store the ready sockets
+ * @param max_events the capacity of events
+ * @param timeout_ms how long to wait at most, -1 for ever
+ * @return the number of events stored, 0 on timeout or -1 on failure
+ */
+int
+microtcp_loop_wait(microtcp_loop_t *loop, microtcp_event_t *events, int max_events,
+                   int timeout_ms);
+
+void
+microtcp_loop_destroy(microtcp_loop_t *loop);
+
 void send_now(microtcp_sock_t * s);
 #endif /* LIB_MICROTCP_H_ */
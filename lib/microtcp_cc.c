@@ -0,0 +1,385 @@
+#include "microtcp.h"
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t cc_now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Half of the data in flight, but never less than two segments */
+static size_t half_pipe(microtcp_sock_t *socket)
+{
+  return socket->pipe / 2 > 2 * MICROTCP_MSS ? socket->pipe / 2 : 2 * MICROTCP_MSS;
+}
+
+/*
+ * Growth of cwnd in slow start for an ACK of acked bytes (RFC 3465): the
+ * bytes acknowledged, so that delayed ACKs do not slow it down, but no
+ * more than the segments one ACK may cover.
+ */
+static size_t slow_start_increase(microtcp_sock_t *socket, size_t acked)
+{
+  size_t limit = (socket->ack_ratio > 1 ? socket->ack_ratio : 1) * MICROTCP_MSS;
+  return acked < limit ? acked : limit;
+}
+
+/*
+ * NewReno (RFC 5681), the bytes acknowledged in slow start and about one
+ * MSS per window in congestion avoidance.
+ */
+static void newreno_init(microtcp_sock_t *socket)
+{
+  socket->cwnd = MICROTCP_INIT_CWND;
+  socket->ssthresh = MICROTCP_INIT_SSTHRESH;
+}
+static void newreno_on_ack(microtcp_sock_t *socket, size_t acked, uint64_t rtt_us)
+{
+  (void)rtt_us;
+  if (socket->cwnd < socket->ssthresh) // slow start
+  {
+    socket->cwnd = socket->cwnd + slow_start_increase(socket, acked);
+  }
+  else // congestion avoidance, about one MSS per window
+  {
+    size_t increase = MICROTCP_MSS * acked / socket->cwnd;
+    socket->cwnd = socket->cwnd + (increase > 0 ? increase : 1);
+  }
+}
+static void newreno_on_loss(microtcp_sock_t *socket)
+{
+  socket->ssthresh = half_pipe(socket);
+  socket->cwnd = socket->ssthresh;
+}
+static void newreno_on_timeout(microtcp_sock_t *socket)
+{
+  socket->ssthresh = half_pipe(socket);
+  socket->cwnd = MICROTCP_MSS;
+}
+static uint64_t no_pacing_rate(microtcp_sock_t *socket)
+{
+  (void)socket;
+  return 0;
+}
+
+const microtcp_cc_ops_t microtcp_cc_newreno = {
+    "newreno", newreno_init, newreno_on_ack, newreno_on_loss,
+    newreno_on_timeout, no_pacing_rate};
+
+/*
+ * CUBIC (RFC 8312). After a reduction the window follows a cubic function
+ * of the time since the reduction, centred on the window where the loss
+ * happened, and never grows slower than Reno would.
+ */
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+typedef struct
+{
+  double w_max;                 /* Window before the last reduction, in segments */
+  double origin;                /* Window the cubic function plateaus at */
+  double k;                     /* Seconds until the plateau */
+  double w_est;                 /* Window Reno would have, in segments */
+  uint64_t epoch_start_us;      /* Start of the current growth epoch, 0 before the first ACK */
+  uint64_t min_rtt_us;
+} cubic_state_t;
+
+static void cubic_init(microtcp_sock_t *socket)
+{
+  memset(socket->cc_priv, 0, sizeof(socket->cc_priv));
+  socket->cwnd = MICROTCP_INIT_CWND;
+  socket->ssthresh = MICROTCP_INIT_SSTHRESH;
+}
+static void cubic_on_ack(microtcp_sock_t *socket, size_t acked, uint64_t rtt_us)
+{
+  cubic_state_t *ca = (cubic_state_t *)socket->cc_priv;
+  if (rtt_us > 0 && (ca->min_rtt_us == 0 || rtt_us < ca->min_rtt_us))
+  {
+    ca->min_rtt_us = rtt_us;
+  }
+  if (socket->cwnd < socket->ssthresh) // slow start
+  {
+    socket->cwnd = socket->cwnd + slow_start_increase(socket, acked);
+    return;
+  }
+  uint64_t now = cc_now_us();
+  double cwnd = (double)socket->cwnd / MICROTCP_MSS;
+  if (ca->epoch_start_us == 0)
+  {
+    ca->epoch_start_us = now;
+    ca->w_est = cwnd;
+    if (cwnd < ca->w_max)
+    {
+      ca->k = cbrt((ca->w_max - cwnd) / CUBIC_C);
+      ca->origin = ca->w_max;
+    }
+    else
+    {
+      ca->k = 0;
+      ca->origin = cwnd;
+    }
+  }
+  /* Aim for where the window should be one round trip from now */
+  double t = (double)(now - ca->epoch_start_us + ca->min_rtt_us) / 1000000.0;
+  double target = ca->origin + CUBIC_C * (t - ca->k) * (t - ca->k) * (t - ca->k);
+  ca->w_est += 3.0 * (1.0 - CUBIC_BETA) / (1.0 + CUBIC_BETA) * (double)acked / (double)socket->cwnd;
+  if (ca->w_est > target) // Reno friendly region
+  {
+    target = ca->w_est;
+  }
+  if (target > 1.5 * cwnd)
+  {
+    target = 1.5 * cwnd;
+  }
+  if (target > cwnd)
+  {
+    size_t increase = (size_t)((target - cwnd) / cwnd * (double)acked);
+    socket->cwnd = socket->cwnd + (increase > 0 ? increase : 1);
+  }
+}
+static void cubic_reduce(microtcp_sock_t *socket)
+{
+  cubic_state_t *ca = (cubic_state_t *)socket->cc_priv;
+  double cwnd = (double)socket->cwnd / MICROTCP_MSS;
+  /* Fast convergence, give up bandwidth to newer flows when the
+     window keeps shrinking */
+  ca->w_max = cwnd < ca->w_max ? cwnd * (1.0 + CUBIC_BETA) / 2.0 : cwnd;
+  ca->epoch_start_us = 0;
+  size_t ssthresh = (size_t)((double)socket->cwnd * CUBIC_BETA);
+  socket->ssthresh = ssthresh > 2 * MICROTCP_MSS ? ssthresh : 2 * MICROTCP_MSS;
+}
+static void cubic_on_loss(microtcp_sock_t *socket)
+{
+  cubic_reduce(socket);
+  socket->cwnd = socket->ssthresh;
+}
+static void cubic_on_timeout(microtcp_sock_t *socket)
+{
+  cubic_reduce(socket);
+  socket->cwnd = MICROTCP_MSS;
+}
+
+const microtcp_cc_ops_t microtcp_cc_cubic = {
+    "cubic", cubic_init, cubic_on_ack, cubic_on_loss,
+    cubic_on_timeout, no_pacing_rate};
+
+/*
+ * BBR-lite, after BBR v1. The bottleneck bandwidth is the highest delivery
+ * rate measured over the last rounds and the propagation delay the lowest
+ * round trip time of the last ten seconds. The window is kept at twice
+ * their product and the sender is paced at a gain of the bandwidth that
+ * cycles to probe for more. Loss alone does not shrink the window.
+ *
+ * A round is approximated by a min_rtt long interval of ACK arrivals, the
+ * delivery rate being the bytes acknowledged during the interval over its
+ * length.
+ */
+#define BBR_BW_ROUNDS 10
+#define BBR_MIN_RTT_WIN_US 10000000
+#define BBR_PROBE_RTT_US 200000
+#define BBR_HIGH_GAIN 289     /* 2/ln(2), in percent */
+#define BBR_DRAIN_GAIN 35     /* 1/BBR_HIGH_GAIN */
+#define BBR_CWND_GAIN 200
+#define BBR_MIN_CWND (4 * MICROTCP_MSS)
+
+enum
+{
+  BBR_STARTUP,
+  BBR_DRAIN,
+  BBR_PROBE_BW,
+  BBR_PROBE_RTT
+};
+
+static const uint32_t bbr_cycle_gain[] = {125, 75, 100, 100, 100, 100, 100, 100};
+
+typedef struct
+{
+  uint64_t bw_samples[BBR_BW_ROUNDS]; /* Delivery rate of the last rounds, bytes per second */
+  uint64_t btl_bw;              /* Highest of bw_samples */
+  uint64_t full_bw;             /* btl_bw when it last grew by a quarter */
+  uint64_t min_rtt_us;
+  uint64_t min_rtt_stamp_us;
+  uint64_t interval_start_us;
+  uint64_t interval_acked;
+  uint64_t probe_rtt_done_us;
+  size_t prior_cwnd;            /* cwnd to return to after PROBE_RTT */
+  uint32_t round;
+  uint32_t full_bw_rounds;      /* Rounds without bandwidth growth */
+  uint32_t full_bw_reached;
+  uint32_t mode;
+  uint32_t cycle_index;
+  uint32_t app_limited;         /* The sender ran out of data during the interval */
+} bbr_state_t;
+
+_Static_assert(sizeof(cubic_state_t) <= sizeof(((microtcp_sock_t *)0)->cc_priv),
+               "cubic_state_t does not fit in cc_priv");
+_Static_assert(sizeof(bbr_state_t) <= sizeof(((microtcp_sock_t *)0)->cc_priv),
+               "bbr_state_t does not fit in cc_priv");
+
+static uint32_t bbr_pacing_gain(const bbr_state_t *bbr)
+{
+  switch (bbr->mode)
+  {
+  case BBR_STARTUP:
+    return BBR_HIGH_GAIN;
+  case BBR_DRAIN:
+    return BBR_DRAIN_GAIN;
+  case BBR_PROBE_BW:
+    return bbr_cycle_gain[bbr->cycle_index];
+  default:
+    return 100;
+  }
+}
+static size_t bbr_bdp(const bbr_state_t *bbr)
+{
+  return (size_t)(bbr->btl_bw * bbr->min_rtt_us / 1000000);
+}
+static void bbr_init(microtcp_sock_t *socket)
+{
+  memset(socket->cc_priv, 0, sizeof(socket->cc_priv));
+  socket->cwnd = MICROTCP_INIT_CWND;
+  socket->ssthresh = MICROTCP_INIT_SSTHRESH;
+}
+/* Called once per round, with a fresh bandwidth sample */
+static void bbr_on_round(microtcp_sock_t *socket, bbr_state_t *bbr, uint64_t now)
+{
+  if (bbr->mode == BBR_STARTUP && !bbr->app_limited)
+  {
+    if (bbr->btl_bw >= bbr->full_bw * 5 / 4)
+    {
+      bbr->full_bw = bbr->btl_bw;
+      bbr->full_bw_rounds = 0;
+    }
+    else if (++bbr->full_bw_rounds >= 3) // the pipe is full
+    {
+      bbr->full_bw_reached = 1;
+      bbr->mode = BBR_DRAIN;
+    }
+  }
+  else if (bbr->mode == BBR_PROBE_BW)
+  {
+    bbr->cycle_index = (bbr->cycle_index + 1) % (sizeof(bbr_cycle_gain) / sizeof(bbr_cycle_gain[0]));
+  }
+  else if (bbr->mode == BBR_PROBE_RTT && now >= bbr->probe_rtt_done_us)
+  {
+    bbr->mode = bbr->full_bw_reached ? BBR_PROBE_BW : BBR_STARTUP;
+    bbr->min_rtt_stamp_us = now;
+    socket->cwnd = bbr->prior_cwnd > socket->cwnd ? bbr->prior_cwnd : socket->cwnd;
+  }
+}
+static void bbr_on_ack(microtcp_sock_t *socket, size_t acked, uint64_t rtt_us)
+{
+  bbr_state_t *bbr = (bbr_state_t *)socket->cc_priv;
+  uint64_t now = cc_now_us();
+  int min_rtt_expired = bbr->min_rtt_stamp_us != 0 &&
+                        now - bbr->min_rtt_stamp_us > BBR_MIN_RTT_WIN_US;
+  if (rtt_us > 0 && (bbr->min_rtt_us == 0 || rtt_us <= bbr->min_rtt_us || min_rtt_expired))
+  {
+    bbr->min_rtt_us = rtt_us;
+    bbr->min_rtt_stamp_us = now;
+  }
+  if (min_rtt_expired && bbr->mode != BBR_PROBE_RTT)
+  {
+    /* Drain the queue for a while to see the propagation delay again */
+    bbr->mode = BBR_PROBE_RTT;
+    bbr->prior_cwnd = socket->cwnd;
+    bbr->probe_rtt_done_us = now + (bbr->min_rtt_us > BBR_PROBE_RTT_US ? bbr->min_rtt_us : BBR_PROBE_RTT_US);
+  }
+
+  if (bbr->interval_start_us == 0)
+  {
+    bbr->interval_start_us = now;
+    bbr->interval_acked = 0;
+  }
+  bbr->interval_acked += acked;
+  bbr->app_limited |= socket->pipe == 0;
+  uint64_t elapsed = now - bbr->interval_start_us;
+  if (bbr->min_rtt_us > 0 && elapsed >= bbr->min_rtt_us)
+  {
+    uint64_t sample = bbr->interval_acked * 1000000 / elapsed;
+    bbr->round++;
+    /* An idle sender says nothing about the bottleneck, unless it still
+       got more through than estimated */
+    if (!bbr->app_limited || sample > bbr->btl_bw)
+    {
+      bbr->bw_samples[bbr->round % BBR_BW_ROUNDS] = sample;
+    }
+    bbr->btl_bw = 0;
+    for (int i = 0; i < BBR_BW_ROUNDS; i++)
+    {
+      bbr->btl_bw = bbr->bw_samples[i] > bbr->btl_bw ? bbr->bw_samples[i] : bbr->btl_bw;
+    }
+    bbr->interval_start_us = now;
+    bbr->interval_acked = 0;
+    bbr_on_round(socket, bbr, now);
+    bbr->app_limited = 0;
+  }
+  if (bbr->mode == BBR_DRAIN && socket->pipe <= bbr_bdp(bbr))
+  {
+    bbr->mode = BBR_PROBE_BW;
+    bbr->cycle_index = 2;
+  }
+
+  if (bbr->mode == BBR_PROBE_RTT)
+  {
+    socket->cwnd = BBR_MIN_CWND;
+    return;
+  }
+  if (bbr->btl_bw == 0) // no estimate yet, grow as in slow start
+  {
+    socket->cwnd = socket->cwnd + acked;
+    return;
+  }
+  size_t target = bbr_bdp(bbr) * BBR_CWND_GAIN / 100;
+  target = target > BBR_MIN_CWND ? target : BBR_MIN_CWND;
+  if (bbr->full_bw_reached)
+  {
+    socket->cwnd = socket->cwnd + acked < target ? socket->cwnd + acked : target;
+  }
+  else if (socket->cwnd < target)
+  {
+    socket->cwnd = socket->cwnd + acked;
+  }
+}
+static void bbr_on_loss(microtcp_sock_t *socket)
+{
+  /* Packet conservation, ACKs grow the window back to the target.
+     ssthresh is only what fast recovery returns to */
+  socket->cwnd = socket->pipe > BBR_MIN_CWND ? socket->pipe : BBR_MIN_CWND;
+  socket->ssthresh = socket->cwnd;
+}
+static void bbr_on_timeout(microtcp_sock_t *socket)
+{
+  bbr_state_t *bbr = (bbr_state_t *)socket->cc_priv;
+  bbr->interval_start_us = 0;
+  socket->cwnd = MICROTCP_MSS;
+}
+static uint64_t bbr_pacing_rate(microtcp_sock_t *socket)
+{
+  bbr_state_t *bbr = (bbr_state_t *)socket->cc_priv;
+  return bbr->btl_bw * bbr_pacing_gain(bbr) / 100;
+}
+
+const microtcp_cc_ops_t microtcp_cc_bbr = {
+    "bbr", bbr_init, bbr_on_ack, bbr_on_loss,
+    bbr_on_timeout, bbr_pacing_rate};
+
+static const microtcp_cc_ops_t *const cc_modules[] = {
+    &microtcp_cc_newreno, &microtcp_cc_cubic, &microtcp_cc_bbr};
+
+int microtcp_set_congestion_control(microtcp_sock_t *socket, const char *name)
+{
+  for (size_t i = 0; i < sizeof(cc_modules) / sizeof(cc_modules[0]); i++)
+  {
+    if (strcmp(cc_modules[i]->name, name) == 0)
+    {
+      socket->cc = cc_modules[i];
+      socket->cc->init(socket);
+      return 0;
+    }
+  }
+  return -1;
+}
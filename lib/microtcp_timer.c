@@ -0,0 +1,186 @@
+#include "microtcp.h"
+#include <string.h>
+#include <time.h>
+
+#define SLOT_BITS __builtin_ctz(MICROTCP_WHEEL_SLOTS)
+#define SLOT_MASK (MICROTCP_WHEEL_SLOTS - 1)
+#define WHEEL_SPAN ((uint64_t)1 << (MICROTCP_WHEEL_LEVELS * SLOT_BITS)) /* Ticks the wheel covers */
+
+static uint64_t timer_now_tick(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000) / MICROTCP_TIMER_TICK_US;
+}
+
+/* The first tick at or after time_us, so that no timer fires early */
+static uint64_t expires_tick(const microtcp_timer_t *timer)
+{
+  return (timer->expires_us + MICROTCP_TIMER_TICK_US - 1) / MICROTCP_TIMER_TICK_US;
+}
+
+/*
+ * Links the timer into the slot of its expiration, on the lowest level
+ * whose turn still reaches it, and no sooner than tick earliest. The slot
+ * of a level that is current has already been spread over the level
+ * below, a timer that lands there waits for the next turn, which is the
+ * right one.
+ */
+static void wheel_insert(microtcp_timer_wheel_t *wheel, microtcp_timer_t *timer, uint64_t earliest)
+{
+  uint64_t expires = expires_tick(timer);
+  expires = expires > earliest ? expires : earliest;
+  if (expires - wheel->tick >= WHEEL_SPAN)
+  {
+    /* Beyond the wheel, it waits at its far end and is put back from there */
+    expires = wheel->tick + WHEEL_SPAN - 1;
+  }
+  uint64_t delta = expires - wheel->tick;
+  uint32_t level = 0;
+  while (level < MICROTCP_WHEEL_LEVELS - 1 && delta >= (uint64_t)1 << ((level + 1) * SLOT_BITS))
+  {
+    level++;
+  }
+  microtcp_timer_t **head = &wheel->slots[level][(expires >> (level * SLOT_BITS)) & SLOT_MASK];
+  timer->next = *head;
+  if (*head != NULL)
+  {
+    (*head)->pprev = &timer->next;
+  }
+  *head = timer;
+  timer->pprev = head;
+  timer->wheel = wheel;
+  timer->level = level;
+  wheel->level_len[level]++;
+  wheel->armed++;
+}
+static void wheel_unlink(microtcp_timer_t *timer)
+{
+  *timer->pprev = timer->next;
+  if (timer->next != NULL)
+  {
+    timer->next->pprev = timer->pprev;
+  }
+  timer->pprev = NULL;
+  timer->wheel->level_len[timer->level]--;
+  timer->wheel->armed--;
+}
+/*
+ * Spreads the current slot of a level over the levels below, before the
+ * current tick runs, so the timers due right now still go off in it.
+ */
+static void wheel_cascade(microtcp_timer_wheel_t *wheel, uint32_t level)
+{
+  microtcp_timer_t **head = &wheel->slots[level][(wheel->tick >> (level * SLOT_BITS)) & SLOT_MASK];
+  while (*head != NULL)
+  {
+    microtcp_timer_t *timer = *head;
+    wheel_unlink(timer);
+    wheel_insert(wheel, timer, wheel->tick);
+  }
+}
+void microtcp_wheel_init(microtcp_timer_wheel_t *wheel, uint64_t now_us)
+{
+  memset(wheel, 0, sizeof(microtcp_timer_wheel_t));
+  wheel->tick = now_us / MICROTCP_TIMER_TICK_US;
+}
+int microtcp_wheel_advance(microtcp_timer_wheel_t *wheel, uint64_t now_us)
+{
+  uint64_t now = now_us / MICROTCP_TIMER_TICK_US;
+  int fired = 0;
+  while (wheel->tick < now)
+  {
+    if (wheel->armed == 0)
+    {
+      wheel->tick = now;
+      break;
+    }
+    if (wheel->level_len[0] == 0)
+    {
+      /* Nothing fires before the next turn of level 0 */
+      uint64_t last = wheel->tick | SLOT_MASK;
+      if (last >= now)
+      {
+        wheel->tick = now;
+        break;
+      }
+      wheel->tick = last;
+    }
+    wheel->tick++;
+    for (uint32_t level = 1;
+         level < MICROTCP_WHEEL_LEVELS && (wheel->tick & (((uint64_t)1 << (level * SLOT_BITS)) - 1)) == 0;
+         level++)
+    {
+      wheel_cascade(wheel, level);
+    }
+    uint64_t tick = wheel->tick;
+    microtcp_timer_t **head = &wheel->slots[0][tick & SLOT_MASK];
+    while (*head != NULL)
+    {
+      microtcp_timer_t *timer = *head;
+      wheel_unlink(timer);
+      if (expires_tick(timer) > tick)
+      {
+        /* Armed beyond the wheel, it has more turns to wait */
+        wheel_insert(wheel, timer, tick + 1);
+        continue;
+      }
+      timer->fire(timer);
+      fired++;
+      if (wheel->tick != tick)
+      {
+        /* The callback armed a timer on the wheel it left empty, which
+           caught up with the clock, this slot is no longer the current */
+        break;
+      }
+    }
+  }
+  return fired;
+}
+uint64_t microtcp_wheel_next(const microtcp_timer_wheel_t *wheel)
+{
+  if (wheel->armed == 0)
+  {
+    return 0;
+  }
+  /* The timers of the upper levels may come down at the next turn of level 0 */
+  uint64_t turn = (wheel->tick | SLOT_MASK) + 1;
+  uint64_t end = wheel->armed > wheel->level_len[0] ? turn : wheel->tick + MICROTCP_WHEEL_SLOTS;
+  for (uint64_t tick = wheel->tick + 1; wheel->level_len[0] > 0 && tick < end; tick++)
+  {
+    if (wheel->slots[0][tick & SLOT_MASK] != NULL)
+    {
+      return tick * MICROTCP_TIMER_TICK_US;
+    }
+  }
+  return end * MICROTCP_TIMER_TICK_US;
+}
+void microtcp_timer_init(microtcp_timer_t *timer, void (*fire)(microtcp_timer_t *timer))
+{
+  memset(timer, 0, sizeof(microtcp_timer_t));
+  timer->fire = fire;
+}
+void microtcp_timer_arm(microtcp_timer_wheel_t *wheel, microtcp_timer_t *timer,
+                        uint64_t expires_us)
+{
+  microtcp_timer_cancel(timer);
+  if (wheel->armed == 0)
+  {
+    /* An idle wheel is not advanced, it catches up with the clock here */
+    uint64_t now = timer_now_tick();
+    wheel->tick = now > wheel->tick ? now : wheel->tick;
+  }
+  timer->expires_us = expires_us;
+  wheel_insert(wheel, timer, wheel->tick + 1);
+}
+void microtcp_timer_cancel(microtcp_timer_t *timer)
+{
+  if (timer->pprev != NULL)
+  {
+    wheel_unlink(timer);
+  }
+}
+int microtcp_timer_armed(const microtcp_timer_t *timer)
+{
+  return timer->pprev != NULL;
+}
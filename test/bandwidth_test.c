@@ -32,12 +32,53 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <limits.h>
+#include <pthread.h>
 
 //#include "../lib/microtcp.h"
 #include "../lib/microtcp.h"
 
 #define CHUNK_SIZE 4096
 
+/* Congestion control module of the microTCP client, NULL for the default */
+static const char *congestion_control = NULL;
+/* Pacing of the microTCP client, -1 for none, otherwise the rate cap */
+static long long pacing_rate = -1;
+/* Whether the microTCP sockets use UDP segmentation and receive offloads */
+static int offload = 0;
+/* Receive buffer of the microTCP server, 0 for the default */
+static long long recvbuf_size = 0;
+/* Workers of the sharded microTCP server, or connections of the client at once, 0 for neither */
+static int jobs = 0;
+
+/* A worker of the sharded microTCP server, with a listener of its own */
+struct server_worker
+{
+  int id;
+  microtcp_sock_t listener;
+  int served;
+  pthread_t thread;
+};
+
+/* Progress of the sharded microTCP server, over all its workers */
+static const char *shard_file;
+static pthread_mutex_t shard_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shard_cond = PTHREAD_COND_INITIALIZER;
+static int shard_accepted = 0;
+static int shard_finished = 0;
+static int shard_failed = 0;
+static ssize_t shard_bytes = 0;
+
+/* A connection of the client, among the others at once */
+struct client_job
+{
+  const char *serverip;
+  uint16_t server_port;
+  const char *file;
+  int exit_code;
+  pthread_t thread;
+};
+
 static inline void
 print_statistics (ssize_t received, struct timespec start, struct timespec end)
 {
@@ -195,6 +236,20 @@ server_microtcp (uint16_t listen_port, const char *file)
     return -EXIT_FAILURE;
   }
 
+  if (offload && microtcp_set_offload (&sock, MICROTCP_OFFLOAD_GSO | MICROTCP_OFFLOAD_GRO) == -1) {
+    microtcp_close (&sock);
+    free (buffer);
+    fclose (fp);
+    return -EXIT_FAILURE;
+  }
+  if (recvbuf_size > 0 && microtcp_set_rcvbuf (&sock, recvbuf_size) == -1) {
+    printf ("Invalid receive buffer size: %lld\n", recvbuf_size);
+    microtcp_close (&sock);
+    free (buffer);
+    fclose (fp);
+    return -EXIT_FAILURE;
+  }
+
   memset (&sin, 0, sizeof(struct sockaddr_in));
   sin.sin_family = AF_INET;
   sin.sin_port = htons (listen_port);
@@ -245,13 +300,144 @@ server_microtcp (uint16_t listen_port, const char *file)
   clock_gettime (CLOCK_MONOTONIC_RAW, &end_time);
   print_statistics (total_bytes, start_time, end_time);
 
-  close (sock.sd);
+  microtcp_close (&sock);
   fclose (fp);
   free (buffer);
 
   return 0;
 }
 
+/*
+ * Serves the connections the kernel steers to the listener of the worker,
+ * one after the other. Each is saved to a file of its own, numbered in the
+ * order they were accepted over all the workers.
+ */
+static void *
+server_worker (void *arg)
+{
+  struct server_worker *worker = (struct server_worker *) arg;
+  uint8_t *buffer;
+  char name[PATH_MAX];
+
+  buffer = (uint8_t *) malloc (CHUNK_SIZE);
+  if (!buffer) {
+    perror ("Allocate application receive buffer");
+    exit (EXIT_FAILURE);
+  }
+
+  for (;;) {
+    microtcp_sock_t conn = microtcp_listener_accept (&worker->listener, NULL, NULL);
+    if (conn.state != ESTABLISHED) {
+      continue;
+    }
+
+    pthread_mutex_lock (&shard_lock);
+    int index = shard_accepted++;
+    pthread_mutex_unlock (&shard_lock);
+
+    snprintf (name, sizeof(name), "%s.%d", shard_file, index);
+    FILE *fp = fopen (name, "w");
+    int failed = fp == NULL;
+    if (!fp) {
+      perror ("Open file for writing");
+    }
+
+    ssize_t received;
+    ssize_t total_bytes = 0;
+    while ((received = microtcp_recv (&conn, buffer, CHUNK_SIZE, 0)) > 0) {
+      total_bytes += received;
+      if (fp && fwrite (buffer, sizeof(uint8_t), received, fp) != (size_t) received) {
+        failed = 1;
+      }
+    }
+    if (fp) {
+      fclose (fp);
+    }
+    /* It shares the descriptor of the listener, which this leaves open */
+    microtcp_close (&conn);
+    printf ("Worker %d: connection %d, %zd bytes\n", worker->id, index, total_bytes);
+
+    pthread_mutex_lock (&shard_lock);
+    worker->served++;
+    shard_finished++;
+    shard_bytes += total_bytes;
+    shard_failed |= failed;
+    pthread_cond_signal (&shard_cond);
+    pthread_mutex_unlock (&shard_lock);
+  }
+  return NULL;
+}
+
+/*
+ * The microTCP server with a worker thread per listener, all of them on
+ * the same port with SO_REUSEPORT. It returns once the workers have
+ * served as many connections as there are workers.
+ */
+int
+server_microtcp_sharded (uint16_t listen_port, const char *file)
+{
+  struct server_worker *workers;
+  struct sockaddr_in sin;
+  struct timespec start_time;
+  struct timespec end_time;
+  int i;
+
+  workers = (struct server_worker *) calloc (jobs, sizeof(struct server_worker));
+  if (!workers) {
+    perror ("Allocate the workers");
+    return -EXIT_FAILURE;
+  }
+
+  memset (&sin, 0, sizeof(struct sockaddr_in));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (listen_port);
+  sin.sin_addr.s_addr = INADDR_ANY;
+
+  /* All the listeners are bound before the first peer connects, so the
+     kernel spreads the peers over all of them */
+  for (i = 0; i < jobs; i++) {
+    microtcp_sock_t *listener = &workers[i].listener;
+    workers[i].id = i;
+    if ((*listener = microtcp_socket (AF_INET, SOCK_STREAM, IPPROTO_TCP)).sd == -1) {
+      perror ("Opening Microtcp socket");
+      return -EXIT_FAILURE;
+    }
+    if (microtcp_set_reuseport (listener, 1) == -1) {
+      perror ("microtcp reuseport");
+      return -EXIT_FAILURE;
+    }
+    if (recvbuf_size > 0 && microtcp_set_rcvbuf (listener, recvbuf_size) == -1) {
+      printf ("Invalid receive buffer size: %lld\n", recvbuf_size);
+      return -EXIT_FAILURE;
+    }
+    if (microtcp_bind (listener, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) == -1
+        || microtcp_listen (listener, jobs) == -1) {
+      perror ("microtcp listen");
+      return -EXIT_FAILURE;
+    }
+  }
+
+  shard_file = file;
+  clock_gettime (CLOCK_MONOTONIC_RAW, &start_time);
+  for (i = 0; i < jobs; i++) {
+    pthread_create (&workers[i].thread, NULL, server_worker, &workers[i]);
+  }
+
+  pthread_mutex_lock (&shard_lock);
+  while (shard_finished < jobs) {
+    pthread_cond_wait (&shard_cond, &shard_lock);
+  }
+  clock_gettime (CLOCK_MONOTONIC_RAW, &end_time);
+  for (i = 0; i < jobs; i++) {
+    printf ("Worker %d served %d connections\n", i, workers[i].served);
+  }
+  print_statistics (shard_bytes, start_time, end_time);
+  pthread_mutex_unlock (&shard_lock);
+
+  /* The workers still wait for peers, they go with the process */
+  return shard_failed ? -EXIT_FAILURE : 0;
+}
+
 int
 client_tcp (const char *serverip, uint16_t server_port, const char *file)
 {
@@ -368,6 +554,24 @@ client_microtcp (const char *serverip, uint16_t server_port, const char *file)
     return -EXIT_FAILURE;
   }
 
+  if (congestion_control != NULL
+      && microtcp_set_congestion_control (&sock, congestion_control) == -1) {
+    printf ("Unknown congestion control: %s\n", congestion_control);
+    microtcp_close (&sock);
+    free (buffer);
+    fclose (fp);
+    return -EXIT_FAILURE;
+  }
+  if (pacing_rate >= 0) {
+    microtcp_set_pacing (&sock, 1, pacing_rate);
+  }
+  if (offload && microtcp_set_offload (&sock, MICROTCP_OFFLOAD_GSO | MICROTCP_OFFLOAD_GRO) == -1) {
+    microtcp_close (&sock);
+    free (buffer);
+    fclose (fp);
+    return -EXIT_FAILURE;
+  }
+
   struct sockaddr_in sin;
   memset (&sin, 0, sizeof(struct sockaddr_in));
   sin.sin_family = AF_INET;
@@ -389,7 +593,7 @@ client_microtcp (const char *serverip, uint16_t server_port, const char *file)
     if (read_items < 1) {
       perror ("Failed read from file");
       microtcp_shutdown (&sock, SHUT_RDWR);
-      close (sock.sd);
+      microtcp_close (&sock);
       free (buffer);
       fclose (fp);
       return -EXIT_FAILURE;
@@ -401,7 +605,7 @@ client_microtcp (const char *serverip, uint16_t server_port, const char *file)
       printf ("Failed to send the"
               " amount of data read from the file.\n");
       microtcp_shutdown (&sock, SHUT_RDWR);
-      close (sock.sd);
+      microtcp_close (&sock);
       free (buffer);
       fclose (fp);
       return -EXIT_FAILURE;
@@ -411,12 +615,47 @@ client_microtcp (const char *serverip, uint16_t server_port, const char *file)
 
   printf ("Data sent. Terminating...\n");
   microtcp_shutdown (&sock, SHUT_RDWR);
-  close (sock.sd);
+  microtcp_close (&sock);
   free (buffer);
   fclose (fp);
   return 0;
 }
 
+static void *
+client_job (void *arg)
+{
+  struct client_job *job = (struct client_job *) arg;
+  job->exit_code = client_microtcp (job->serverip, job->server_port, job->file);
+  return NULL;
+}
+
+/* Sends the file over as many microTCP connections at once as there are jobs */
+int
+client_microtcp_parallel (const char *serverip, uint16_t server_port, const char *file)
+{
+  struct client_job *clients;
+  int exit_code = 0;
+  int i;
+
+  clients = (struct client_job *) calloc (jobs, sizeof(struct client_job));
+  if (!clients) {
+    perror ("Allocate the connections");
+    return -EXIT_FAILURE;
+  }
+  for (i = 0; i < jobs; i++) {
+    clients[i].serverip = serverip;
+    clients[i].server_port = server_port;
+    clients[i].file = file;
+    pthread_create (&clients[i].thread, NULL, client_job, &clients[i]);
+  }
+  for (i = 0; i < jobs; i++) {
+    pthread_join (clients[i].thread, NULL);
+    exit_code = clients[i].exit_code != 0 ? clients[i].exit_code : exit_code;
+  }
+  free (clients);
+  return exit_code;
+}
+
 int
 main (int argc, char **argv)
 {
@@ -429,7 +668,7 @@ main (int argc, char **argv)
   uint8_t use_microtcp = 0;
 
   /* A very easy way to parse command line arguments */
-  while ((opt = getopt (argc, argv, "hsmf:p:a:")) != -1) {
+  while ((opt = getopt (argc, argv, "hsmof:p:a:c:r:w:j:")) != -1) {
     switch (opt)
       {
       /* If -s is set, program runs on server mode */
@@ -440,6 +679,10 @@ main (int argc, char **argv)
       case 'm':
         use_microtcp = 1;
         break;
+        /* if -o is set the microTCP sockets use UDP GSO and GRO */
+      case 'o':
+        offload = 1;
+        break;
       case 'f':
         filestr = strdup (optarg);
         /* A few checks will be nice here...*/
@@ -452,6 +695,18 @@ main (int argc, char **argv)
       case 'a':
         ipstr = strdup (optarg);
         break;
+      case 'c':
+        congestion_control = optarg;
+        break;
+      case 'r':
+        pacing_rate = atoll (optarg);
+        break;
+      case 'w':
+        recvbuf_size = atoll (optarg);
+        break;
+      case 'j':
+        jobs = atoi (optarg);
+        break;
 
       default:
         printf (
@@ -459,10 +714,17 @@ main (int argc, char **argv)
             "Options:\n"
             "   -s                  If set, the program runs as server. Otherwise as client.\n"
             "   -m                  If set, the program uses the microTCP implementation. Otherwise the normal TCP.\n"
+            "   -o                  If set, the microTCP sockets use UDP segmentation and receive offloads.\n"
             "   -f <string>         If -s is set the -f option specifies the filename of the file that will be saved.\n"
             "                       If not, is the source file at the client side that will be sent to the server.\n"
             "   -p <int>            The listening port of the server\n"
             "   -a <string>         The IP address of the server. This option is ignored if the tool runs in server mode.\n"
+            "   -c <string>         The congestion control of the microTCP client: newreno (default), cubic or bbr.\n"
+            "   -r <int>            Pace the segments of the microTCP client, at most <int> bytes per second (0 for no cap).\n"
+            "   -w <int>            The receive buffer, and window, of the microTCP server in bytes.\n"
+            "   -j <int>            With -s and -m, serve with <int> worker threads, each with a listener of its own\n"
+            "                       on the port, until <int> connections are served, each saved to <file>.<n>.\n"
+            "                       With -m only, open <int> connections at once, each sending the file.\n"
             "   -h                  prints this help\n");
         exit (EXIT_FAILURE);
       }
@@ -477,7 +739,10 @@ main (int argc, char **argv)
    */
   if (is_server) {
 
-    if (use_microtcp) {
+    if (use_microtcp && jobs > 0) {
+      exit_code = server_microtcp_sharded (port, filestr);
+    }
+    else if (use_microtcp) {
       exit_code = server_microtcp (port, filestr);
     }
     else {
@@ -485,7 +750,10 @@ main (int argc, char **argv)
     }
   }
   else {
-    if (use_microtcp) {
+    if (use_microtcp && jobs > 0) {
+      exit_code = client_microtcp_parallel (ipstr, port, filestr);
+    }
+    else if (use_microtcp) {
       exit_code = client_microtcp (ipstr, port, filestr);
     }
     else {
@@ -0,0 +1,113 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks every CRC-32 engine the CPU supports against the byte at a time
+ * table, over random lengths, alignments and seeds, in one go and split
+ * in two as the checksum of a segment is.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "../utils/crc32.h"
+
+#define BUF_SIZE 8192
+#define ROUNDS 20000
+
+struct engine
+{
+  const char *name;
+  crc32_engine_t fn;
+};
+
+static int
+check_engine (const struct engine *e, const uint8_t *buf)
+{
+  int failures = 0;
+  int i;
+  for (i = 0; i < ROUNDS; i++) {
+    size_t offset = rand () % 16;
+    /* Mostly short lengths, where the tails of the engines are */
+    size_t len = rand () % (i % 4 == 0 ? BUF_SIZE - 16 : 300);
+    size_t split = len > 0 ? rand () % (len + 1) : 0;
+    uint32_t seed = i % 2 == 0 ? 0xffffffff : ((uint32_t) rand () << 16) ^ rand ();
+    const uint8_t *data = buf + offset;
+
+    uint32_t expected = crc32_bytes (seed, data, len);
+    uint32_t whole = e->fn (seed, data, len);
+    uint32_t parts = e->fn (e->fn (seed, data, split), data + split, len - split);
+    if (whole != expected || parts != expected) {
+      if (failures++ < 10) {
+        printf ("%s: offset %zu len %zu split %zu seed %08x: %08x %08x, expected %08x\n",
+                e->name, offset, len, split, seed, whole, parts, expected);
+      }
+    }
+  }
+  printf ("%s: %s\n", e->name, failures == 0 ? "OK" : "FAILED");
+  return failures;
+}
+
+int
+main (int argc, char **argv)
+{
+  static const uint8_t check[] = "123456789";
+  uint8_t *buf = malloc (BUF_SIZE);
+  struct engine engines[4];
+  int n = 0;
+  int failures = 0;
+  int i;
+
+  srand (argc > 1 ? atoi (argv[1]) : 1);
+  for (i = 0; i < BUF_SIZE; i++) {
+    buf[i] = rand ();
+  }
+
+  /* The check value of the CRC-32 */
+  if (crc32 (check, 9) != 0xcbf43926) {
+    printf ("crc32(\"123456789\") = %08x, expected cbf43926\n", crc32 (check, 9));
+    failures++;
+  }
+
+  crc32_init ();
+  engines[n].name = "slicing-by-8";
+  engines[n++].fn = crc32_slice8;
+#ifdef CRC32_HAVE_PCLMUL
+  if (__builtin_cpu_supports ("pclmul") && __builtin_cpu_supports ("sse4.1")) {
+    engines[n].name = "pclmul";
+    engines[n++].fn = crc32_pclmul;
+  }
+#endif
+#ifdef CRC32_HAVE_ARMV8
+  if (getauxval (AT_HWCAP) & HWCAP_CRC32) {
+    engines[n].name = "armv8";
+    engines[n++].fn = crc32_armv8;
+  }
+#endif
+  engines[n].name = "update_crc32";
+  engines[n++].fn = update_crc32;
+
+  for (i = 0; i < n; i++) {
+    failures += check_engine (&engines[i], buf);
+  }
+  free (buf);
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,180 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the SACK blocks of a receiver with a scaled window. A plain UDP
+ * socket plays the sender: it opens the connection, leaves a hole and
+ * sends out of order data past it. A range shorter than one unit of the
+ * window scale goes unreported, a longer one is reported rounded inwards
+ * to whole units.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../lib/microtcp.h"
+#include "../utils/crc32.h"
+
+#define ISN 1000
+
+static struct sockaddr_in server_addr;
+static int failures;
+
+/* Accepts the connection and reads until the hole is filled */
+static void *
+receiver (void *arg)
+{
+  microtcp_sock_t *sock = arg;
+  struct sockaddr_in client_addr;
+  uint8_t buf[4096];
+
+  microtcp_accept (sock, (struct sockaddr *) &client_addr, sizeof(client_addr));
+  if (microtcp_recv (sock, buf, sizeof(buf), 0) <= 0) {
+    printf ("receiver: no data\n");
+    failures++;
+  }
+  return NULL;
+}
+
+static void
+send_segment (int sd, uint32_t seq, uint32_t ack, uint16_t control, uint32_t options,
+              uint32_t shift, size_t len)
+{
+  uint8_t packet[sizeof(microtcp_header_t) + MICROTCP_MSS];
+  microtcp_header_t header;
+  memset (&header, 0, sizeof(header));
+  header.seq_number = seq;
+  header.ack_number = ack;
+  header.control = control;
+  header.window = 0xffff;
+  header.data_len = len;
+  header.future_use0 = options;
+  header.future_use1 = options != 0 ? 1 : 0;
+  header.future_use2 = shift;
+  memcpy (packet, &header, sizeof(header));
+  memset (packet + sizeof(header), 'x', len);
+  header.checksum = crc32 (packet, sizeof(header) + len);
+  memcpy (packet, &header, sizeof(header));
+  sendto (sd, packet, sizeof(header) + len, 0, (struct sockaddr *) &server_addr,
+          sizeof(server_addr));
+}
+
+static int
+receive_header (int sd, microtcp_header_t *header)
+{
+  if (recv (sd, header, sizeof(*header), 0) != sizeof(*header)) {
+    printf ("no answer from the receiver\n");
+    failures++;
+    return -1;
+  }
+  return 0;
+}
+
+/* Sends an out of order segment and checks the SACK blocks of the ACK */
+static void
+check_sack (int sd, uint32_t base, uint32_t syn_ack_seq, uint32_t offset, uint32_t len,
+            uint32_t expected)
+{
+  microtcp_header_t ack;
+  uint32_t words[3];
+  int found = 0;
+  int i;
+
+  send_segment (sd, base + offset, syn_ack_seq + 1, 1 << 11, 0, 0, len);
+  if (receive_header (sd, &ack) == -1) {
+    return;
+  }
+  words[0] = ack.future_use0;
+  words[1] = ack.future_use1;
+  words[2] = ack.future_use2;
+  for (i = 0; i < 3; i++) {
+    if (words[i] == expected && expected != 0) {
+      found = 1;
+    }
+    else if (words[i] != 0) {
+      printf ("[%u, %u): unexpected block %08x\n", offset, offset + len, words[i]);
+      failures++;
+    }
+  }
+  if (ack.ack_number != base || (expected != 0 && !found)) {
+    printf ("[%u, %u): ACK of %u, expected the hole at 0 and block %08x\n",
+            offset, offset + len, ack.ack_number - base, expected);
+    failures++;
+  }
+}
+
+int
+main (int argc, char **argv)
+{
+  microtcp_sock_t sock = microtcp_socket (AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  struct timeval timeout = { 2, 0 };
+  microtcp_header_t syn_ack;
+  pthread_t thread;
+  uint32_t shift;
+  uint32_t unit;
+  uint32_t base = ISN + 2;      /* The ACK of the handshake takes a number too */
+  int sd;
+
+  memset (&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  server_addr.sin_port = htons (20000 + getpid () % 20000);
+  if (microtcp_bind (&sock, (struct sockaddr *) &server_addr, sizeof(server_addr)) == -1) {
+    perror ("bind");
+    return EXIT_FAILURE;
+  }
+  pthread_create (&thread, NULL, receiver, &sock);
+
+  sd = socket (AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  setsockopt (sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  send_segment (sd, ISN, 0, 1 << 13, MICROTCP_OPT_SACK | MICROTCP_OPT_WSCALE, 0, 0);
+  if (receive_header (sd, &syn_ack) == -1) {
+    return EXIT_FAILURE;
+  }
+  send_segment (sd, ISN + 1, syn_ack.seq_number + 1, 1 << 11, 0, 0, 0);
+
+  /* The autotuned window of the receiver is scaled */
+  shift = syn_ack.future_use2;
+  unit = 1u << shift;
+  if (!(syn_ack.future_use0 & MICROTCP_OPT_SACK) || shift == 0 || 2 * unit + 200 > MICROTCP_MSS) {
+    printf ("options %x shift %u, expected SACK and a small scale\n", syn_ack.future_use0, shift);
+    return EXIT_FAILURE;
+  }
+
+  /* Inside one unit past the hole, there is no whole unit to report */
+  check_sack (sd, base, syn_ack.seq_number, unit + 1, unit - 2, 0);
+  /* Units 4 and 5 are held whole, the bytes around them are not reported */
+  check_sack (sd, base, syn_ack.seq_number, 4 * unit - 100, 2 * unit + 200, 4 << 16 | 2);
+
+  /* Filling the hole lets the receiver go */
+  send_segment (sd, base, syn_ack.seq_number + 1, 1 << 11, 0, 0, unit + 1);
+  pthread_join (thread, NULL);
+
+  printf ("sack: %s\n", failures == 0 ? "OK" : "FAILED");
+  close (sd);
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,245 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the timer wheel against the times its timers were armed for:
+ * none fires early, none is late past the tick it is due in, a cancelled
+ * one never fires, and those on the upper levels and beyond the wheel
+ * come down to fire on time, with the clock advanced in random steps or
+ * to where microtcp_wheel_next() says.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include "../lib/microtcp.h"
+
+#define TIMERS 500
+#define ROUNDS 200
+#define TICK MICROTCP_TIMER_TICK_US
+/* Ticks one turn of the whole wheel covers */
+#define SPAN ((uint64_t)1 << (MICROTCP_WHEEL_LEVELS * __builtin_ctz (MICROTCP_WHEEL_SLOTS)))
+
+struct test_timer
+{
+  microtcp_timer_t timer;
+  uint64_t expires_us;
+  uint64_t due_tick;            /* The tick it has to fire in */
+  int fired;
+  int rearm;
+  int expected;
+};
+
+static uint64_t clock_us;       /* The time the wheel is advanced to */
+static uint64_t last_tick;      /* Tick of the last timer fired, for their order */
+static microtcp_timer_wheel_t wheel;
+static int failures;
+
+#define TEST_TIMER(t) ((struct test_timer *) ((char *) (t) - offsetof (struct test_timer, timer)))
+
+static void
+fail (const char *what, const struct test_timer *t)
+{
+  if (failures++ < 10) {
+    printf ("%s: expires %llu, clock %llu\n", what,
+            (unsigned long long) t->expires_us, (unsigned long long) clock_us);
+  }
+}
+
+/*
+ * Arms the test timer. One that expires in a tick the wheel has already
+ * run goes off in the next one.
+ */
+static void
+arm (struct test_timer *t, uint64_t expires_us)
+{
+  t->expires_us = expires_us;
+  microtcp_timer_arm (&wheel, &t->timer, expires_us);
+  t->due_tick = (expires_us + TICK - 1) / TICK;
+  t->due_tick = t->due_tick > wheel.tick ? t->due_tick : wheel.tick + 1;
+}
+
+static void
+on_fire (microtcp_timer_t *timer)
+{
+  struct test_timer *t = TEST_TIMER (timer);
+  if (clock_us < t->expires_us) {
+    fail ("fired early", t);
+  }
+  if (t->due_tick < last_tick) {
+    fail ("fired out of order", t);
+  }
+  last_tick = t->due_tick;
+  t->fired++;
+  if (t->rearm > 0) {
+    t->rearm--;
+    arm (t, clock_us + 1 + rand () % (200 * TICK));
+  }
+}
+
+/*
+ * A delay on the first two levels of the wheel, or with far set on every
+ * level and beyond the wheel
+ */
+static uint64_t
+random_delay (int far)
+{
+  switch (rand () % (far ? 5 : 2)) {
+  case 0:
+    return rand () % (MICROTCP_WHEEL_SLOTS * TICK);
+  case 1:
+    return rand () % (MICROTCP_WHEEL_SLOTS * MICROTCP_WHEEL_SLOTS * TICK);
+  case 2:
+    return ((uint64_t) rand () << 8) % (SPAN * TICK / MICROTCP_WHEEL_SLOTS);
+  case 3:
+    return ((uint64_t) rand () << 16) % (SPAN * TICK);
+  default:
+    return SPAN * TICK + ((uint64_t) rand () << 16) % (2 * SPAN * TICK);
+  }
+}
+
+/* Advances the wheel to now_us and checks that what is due went off */
+static void
+advance (struct test_timer *timers, uint64_t now_us)
+{
+  int i;
+  clock_us = now_us;
+  last_tick = 0;
+  microtcp_wheel_advance (&wheel, now_us);
+  for (i = 0; i < TIMERS; i++) {
+    if (microtcp_timer_armed (&timers[i].timer) && timers[i].due_tick <= now_us / TICK) {
+      fail ("fired late", &timers[i]);
+      microtcp_timer_cancel (&timers[i].timer);
+    }
+  }
+}
+
+static int
+armed_timers (const struct test_timer *timers)
+{
+  int armed = 0;
+  int i;
+  for (i = 0; i < TIMERS; i++) {
+    armed += microtcp_timer_armed (&timers[i].timer);
+  }
+  return armed;
+}
+
+/*
+ * Arms the timers at random delays, cancels some of them and re-arms
+ * others, and advances the clock by steps or to the next wakeup until
+ * they are all gone.
+ */
+static void
+check_round (struct test_timer *timers, int by_next)
+{
+  uint64_t start_us = clock_us;
+  int i;
+
+  /* Stepping to the next wakeup goes a turn of level 0 at a time, the
+     timers far away are left to the random steps */
+  for (i = 0; i < TIMERS; i++) {
+    timers[i].fired = 0;
+    timers[i].rearm = rand () % 8 == 0 ? 1 + rand () % 3 : 0;
+    timers[i].expected = 1 + timers[i].rearm;
+    arm (&timers[i], start_us + random_delay (!by_next));
+  }
+  /* Arming again moves a timer, and cancelling takes it off */
+  for (i = 0; i < TIMERS / 4; i++) {
+    int k = rand () % TIMERS;
+    if (rand () % 2) {
+      arm (&timers[k], start_us + random_delay (!by_next));
+      timers[k].expected = 1 + timers[k].rearm;
+    }
+    else {
+      microtcp_timer_cancel (&timers[k].timer);
+      timers[k].expected = 0;
+    }
+  }
+  if ((int) wheel.armed != armed_timers (timers)) {
+    printf ("armed %u, expected %d\n", wheel.armed, armed_timers (timers));
+    failures++;
+  }
+
+  while (wheel.armed > 0) {
+    uint64_t now_us;
+    if (by_next) {
+      now_us = microtcp_wheel_next (&wheel);
+      if (now_us / TICK <= clock_us / TICK) {
+        printf ("next %llu not after the clock %llu\n",
+                (unsigned long long) now_us, (unsigned long long) clock_us);
+        failures++;
+        now_us = clock_us + TICK;
+      }
+      for (i = 0; i < TIMERS; i++) {
+        if (microtcp_timer_armed (&timers[i].timer) && timers[i].due_tick < now_us / TICK) {
+          fail ("next after the timer", &timers[i]);
+        }
+      }
+    }
+    else {
+      /* From single ticks to whole turns of the upper levels */
+      now_us = clock_us + ((uint64_t) rand () << (rand () % 24)) % (SPAN * TICK / 4);
+    }
+    /* A timer on time is due in the tick the clock reaches */
+    advance (timers, now_us);
+  }
+
+  for (i = 0; i < TIMERS; i++) {
+    if (timers[i].fired != timers[i].expected) {
+      fail (timers[i].expected == 0 ? "cancelled but fired"
+            : timers[i].fired < timers[i].expected ? "fired too few times" : "fired too often",
+            &timers[i]);
+    }
+  }
+}
+
+int
+main (int argc, char **argv)
+{
+  struct test_timer *timers = calloc (TIMERS, sizeof (struct test_timer));
+  struct timespec ts;
+  int i;
+
+  srand (argc > 1 ? atoi (argv[1]) : 1);
+  /* An idle wheel catches up with the monotonic clock once a timer is
+     armed, the clock of the test stays ahead of it */
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  clock_us = ((uint64_t) ts.tv_sec + 10) * 1000000 + 42;
+  microtcp_wheel_init (&wheel, clock_us);
+  for (i = 0; i < TIMERS; i++) {
+    microtcp_timer_init (&timers[i].timer, on_fire);
+  }
+
+  /* An empty wheel has nothing to wake up for */
+  if (microtcp_wheel_next (&wheel) != 0) {
+    printf ("next of an empty wheel is not 0\n");
+    failures++;
+  }
+  for (i = 0; i < ROUNDS; i++) {
+    check_round (timers, i % 2);
+  }
+
+  printf ("timer wheel: %s\n", failures == 0 ? "OK" : "FAILED");
+  free (timers);
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}